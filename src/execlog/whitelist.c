@@ -1,5 +1,7 @@
 #include <linux/version.h>
 #include <linux/err.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
 #include <linux/spinlock.h>
 #include "execlog.h"
 #include "whitelist.h"
@@ -14,11 +16,40 @@ struct white_process {
 };
 #define ARGV_START(row) (row->data + row->filename_len + 1)
 
-static struct white_process *whitelist = NULL;
+/* Radix trie of the rules, keyed by the filename, a '\0', then the start
+ * of argv (the data of a row): an argv matches if it walks through the
+ * end of a rule, checking each byte once whatever the number of rules */
+struct white_node {
+	/** Next child of the same parent, starting with another byte */
+	struct white_node *sibling;
+	struct white_node *child;
+	/** A rule ends at the end of this label */
+	bool match;
+	size_t len;
+	char label[];
+};
+
+struct whitelist_index {
+	struct white_node *root;
+};
+
+/* Position inside the trie during a lookup */
+struct white_cursor {
+	const struct white_node *node;
+	size_t pos;
+};
+
+enum white_walk {
+	WALK_CONTINUE,
+	WALK_MATCH,
+	WALK_NO_RULE,
+};
 
 static struct white_process* whiterow_from_string(char *str);
 static int is_already_whitelisted(struct white_process *head, struct white_process *new_row);
 static char * whitelist_print(struct white_process *row, char * buf, size_t *avail);
+static int whitelist_index_build(struct whitelist_index *index, struct white_process *rows);
+static void whitelist_index_destroy(struct whitelist_index *index);
 
 #include "whitelist_helper.c"
 
@@ -26,7 +57,7 @@ static char * whitelist_print(struct white_process *row, char * buf, size_t *ava
 #define FIELD_SEPARATOR '|'
 
 static struct white_process*
-whiterow_from_string(char *str) __must_hold(whitelist_sanitylock)
+whiterow_from_string(char *str)
 {
 	struct white_process *new_row = NULL;
 	char *separator_pos;
@@ -54,7 +85,7 @@ whiterow_from_string(char *str) __must_hold(whitelist_sanitylock)
 		return NULL;
 
 	/* Allocate new memory */
-	new_row = kmalloc(sizeof(struct white_process) + filename_len + argv_start_len + 2, GFP_ATOMIC);
+	new_row = kmalloc(sizeof(struct white_process) + filename_len + argv_start_len + 2, GFP_KERNEL);
 	if (unlikely(new_row == NULL))
 		return NULL;
 
@@ -77,7 +108,7 @@ whiterow_from_string(char *str) __must_hold(whitelist_sanitylock)
 }
 
 static int
-is_already_whitelisted(struct white_process *head, struct white_process *new_row) __must_hold(whitelist_sanitylock)
+is_already_whitelisted(struct white_process *head, struct white_process *new_row)
 {
 	struct white_process *row = head;
 
@@ -91,12 +122,147 @@ is_already_whitelisted(struct white_process *head, struct white_process *new_row
 	return 0;
 }
 
+static struct white_node *
+white_node_new(const char *label, size_t len)
+{
+	struct white_node *node;
+
+	node = kmalloc(sizeof(struct white_node) + len, GFP_KERNEL);
+	if (unlikely(node == NULL))
+		return NULL;
+	node->sibling = NULL;
+	node->child = NULL;
+	node->match = false;
+	node->len = len;
+	memcpy(node->label, label, len);
+	return node;
+}
+
+static void
+white_node_free(struct white_node *node)
+{
+	struct white_node *next;
+
+	/* Iterative: the depth of the trie is only bounded by the rules */
+	while (node != NULL) {
+		if (node->child != NULL) {
+			/* Move the children in front of the siblings */
+			for (next = node->child; next->sibling != NULL; next = next->sibling);
+			next->sibling = node->sibling;
+			node->sibling = node->child;
+		}
+		next = node->sibling;
+		kfree(node);
+		node = next;
+	}
+}
+
+static int
+white_node_insert(struct white_node *parent, const char *key, size_t len)
+{
+	struct white_node **link, *node, *prefix;
+	size_t common;
+
+	while (len > 0) {
+		for (link = &parent->child; *link != NULL; link = &(*link)->sibling)
+			if ((*link)->label[0] == key[0])
+				break;
+
+		node = *link;
+		if (node == NULL) {
+			node = white_node_new(key, len);
+			if (unlikely(node == NULL))
+				return -ENOMEM;
+			*link = node;
+			parent = node;
+			break;
+		}
+
+		for (common = 1; common < node->len && common < len && node->label[common] == key[common]; ++common);
+
+		if (common < node->len) {
+			/* Split the label: the common part becomes the parent of the rest */
+			prefix = white_node_new(node->label, common);
+			if (unlikely(prefix == NULL))
+				return -ENOMEM;
+			prefix->sibling = node->sibling;
+			prefix->child = node;
+			node->sibling = NULL;
+			node->len -= common;
+			memmove(node->label, node->label + common, node->len);
+			*link = prefix;
+			node = prefix;
+		}
+
+		parent = node;
+		key += common;
+		len -= common;
+	}
+	parent->match = true;
+	return 0;
+}
+
+static int
+whitelist_index_build(struct whitelist_index *index, struct white_process *rows)
+{
+	struct white_process *row;
+
+	index->root = white_node_new("", 0);
+	if (unlikely(index->root == NULL))
+		return -ENOMEM;
+
+	for (row = rows; row != NULL; row = row->next) {
+		/* A filename without argv start matches as soon as its '\0' does */
+		if (white_node_insert(index->root, row->data, row->filename_len + 1 + row->argv_start_len) != 0) {
+			white_node_free(index->root);
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+static void
+whitelist_index_destroy(struct whitelist_index *index)
+{
+	white_node_free(index->root);
+}
+
+static enum white_walk
+white_cursor_walk(struct white_cursor *cursor, const char *data, size_t len)
+__must_hold(RCU)
+{
+	const struct white_node *node = cursor->node;
+	size_t pos = cursor->pos;
+	size_t i;
+
+	for (i = 0; i < len; ++i) {
+		if (pos == node->len) {
+			for (node = node->child; node != NULL; node = node->sibling)
+				if (node->label[0] == data[i])
+					break;
+			if (node == NULL)
+				return WALK_NO_RULE;
+			pos = 0;
+		}
+		if (node->label[pos] != data[i])
+			return WALK_NO_RULE;
+		++pos;
+		if (pos == node->len && node->match)
+			return WALK_MATCH;
+	}
+
+	cursor->node = node;
+	cursor->pos = pos;
+	return WALK_CONTINUE;
+}
+
 int
 is_whitelisted(const char *filename, const char *argv_start, size_t argv_size)
 {
 	size_t filename_len;
-	unsigned long flags;
-	struct white_process *row;
+	struct whitelist *current_whitelist;
+	struct white_cursor cursor;
+	enum white_walk walk;
 
 	filename_len = strnlen(filename, MAX_EXEC_PATH);
 
@@ -107,37 +273,40 @@ is_whitelisted(const char *filename, const char *argv_start, size_t argv_size)
 
 	/*Check if the entry is whitelisted*/
 
-	read_lock_irqsave(&whitelist_rwlock, flags);
+	rcu_read_lock();
 
 #ifdef ALSOROOT
-	if ((!also_root) && current_is_root())
+	if ((!READ_ONCE(also_root)) && current_is_root())
 		goto whitelisted;
 #endif /* ALSOROOT */
 
-	row = whitelist;
-	while (row != NULL) {
-		if (row->filename_len == filename_len && (memcmp(row->data, filename, filename_len) == 0)) {
-			if (row->argv_start_len == 0)
-				goto whitelisted;
-			if (argv_size >= row->argv_start_len && (memcmp(ARGV_START(row), argv_start, row->argv_start_len) == 0))
-				goto whitelisted;
-		}
-		row = row->next;
-	}
+	current_whitelist = rcu_dereference(whitelist);
+	if (current_whitelist == NULL)
+		goto not_whitelisted;
+
+	cursor.node = current_whitelist->index.root;
+	cursor.pos = 0;
+	/* The rules never match inside the filename, which ends with a '\0' */
+	walk = white_cursor_walk(&cursor, filename, filename_len + 1);
+	if (walk == WALK_CONTINUE)
+		walk = white_cursor_walk(&cursor, argv_start, argv_size);
+	if (walk == WALK_MATCH)
+		goto whitelisted;
 
-	read_unlock_irqrestore(&whitelist_rwlock, flags);
+not_whitelisted:
+	rcu_read_unlock();
 
 	return NOT_WHITELISTED;
 
 whitelisted:
-	read_unlock_irqrestore(&whitelist_rwlock, flags);
+	rcu_read_unlock();
 
 	return WHITELISTED;
 }
 
 static char *
 whitelist_print(struct white_process *row, char * buf, size_t *avail)
-__must_hold(whitelist_rwlock)
+__must_hold(RCU)
 {
 	int ret;
 	size_t rem = *avail;
@@ -14,11 +14,7 @@ struct current_details {
 	uid_t euid /** EUID of 'current' */;
 	uid_t gid  /** GID of 'current' */;
 	uid_t egid /** EGID of 'current' */;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
-	const char *tty; /** TTY, if existant, used by 'current', '\0' otherwise */;
-#else /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0) */
-	char tty[64] /** TTY, if existant, used by 'current', '\0' otherwise */;
-#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(4, 2, 0) */
+	char tty[64] /** TTY, if existant, used by 'current', '\0' otherwise. Always copied: records can be read long after the TTY is gone */;
 };
 
 #define CURRENT_DETAILS_FORMAT "p:%d s:%d pp:%d u:%d g:%d eu:%d eg:%d t:%s"
@@ -28,7 +24,6 @@ struct current_details {
 				      details.tty
 
 static const char null_tty[] = "NULL tty";
-static const char null_tty_short[] = "NULL";
 
 static inline void
 fill_current_details(struct current_details *details)
@@ -55,9 +50,10 @@ fill_current_details(struct current_details *details)
 		details->ppid = 0;
 	details->sid = task_session_vnr(current);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
-	details->tty = tty_name(current->signal->tty);
+	strlcpy(details->tty, tty_name(current->signal->tty),
+		sizeof(details->tty));
 	if (strcmp(details->tty, null_tty) == 0)
-		details->tty = null_tty_short;
+		details->tty[4] = '\0';
 #else /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0) */
 	tty_name(current->signal->tty, details->tty);
 	if (memcmp(details->tty, null_tty, sizeof(null_tty) - 1) == 0)
@@ -0,0 +1,157 @@
+#include <linux/dcache.h>
+#include <linux/err.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/jiffies.h>
+#include <linux/mm.h>
+#include <linux/mount.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/version.h>
+#include "sparse_compat.h"
+#include "exe_path_cache.h"
+
+/* Direct mapped on the inode: a new path simply replaces the one in its slot */
+#define EXE_PATH_CACHE_BITS 8
+#define EXE_PATH_CACHE_SIZE (1 << EXE_PATH_CACHE_BITS)
+
+/* Renames of the parent directories and unmounts are not tracked:
+ * entries are resolved again after that delay */
+#define EXE_PATH_CACHE_TTL (60 * HZ)
+
+struct exe_path_entry {
+	struct rcu_head rcu;
+	/** Key, only compared, never dereferenced */
+	const struct inode *inode;
+	/** Generation of the inode, in case it was freed and reused */
+	u32 generation;
+	/* Checked on every hit, a rename of the file changes them */
+	const struct vfsmount *mnt;
+	const struct dentry *dentry;
+	const struct dentry *parent;
+	u32 name_hash;
+	/** Time (in jiffies) after which the entry is not used anymore */
+	unsigned long expires;
+	/** Length of the path, including the final '\0' */
+	int len;
+	char path[];
+};
+
+static struct exe_path_entry *exe_path_cache[EXE_PATH_CACHE_SIZE];
+
+/* The caller holds a reference on the file: its dentry and inode are the
+ * live ones, a stale entry can't match all of them */
+static inline bool exe_path_match(const struct exe_path_entry *entry,
+				  const struct path *path,
+				  const struct inode *inode)
+{
+	const struct dentry *dentry = path->dentry;
+
+	return entry->inode == inode &&
+	       entry->generation == inode->i_generation &&
+	       entry->dentry == dentry &&
+	       entry->mnt == path->mnt &&
+	       entry->parent == READ_ONCE(dentry->d_parent) &&
+	       entry->name_hash == READ_ONCE(dentry->d_name.hash) &&
+	       time_before(jiffies, entry->expires);
+}
+
+char *file_path_get(struct file *file, char *buffer, int length)
+{
+	const struct path *path = &file->f_path;
+	struct inode *inode = path->dentry->d_inode;
+	struct exe_path_entry *entry, *old;
+	const struct dentry *parent;
+	unsigned int slot;
+	u32 name_hash;
+	char *p;
+	int len;
+
+	if (unlikely(inode == NULL))
+		return NULL;
+
+	slot = hash_ptr(inode, EXE_PATH_CACHE_BITS);
+
+	rcu_read_lock();
+	entry = rcu_dereference(exe_path_cache[slot]);
+	if (entry != NULL && entry->len <= length &&
+	    exe_path_match(entry, path, inode)) {
+		memcpy(buffer, entry->path, entry->len);
+		rcu_read_unlock();
+		return buffer;
+	}
+	rcu_read_unlock();
+
+	/* Taken before d_path: a rename meanwhile makes the new entry stale */
+	parent = READ_ONCE(path->dentry->d_parent);
+	name_hash = READ_ONCE(path->dentry->d_name.hash);
+	smp_rmb();
+	p = d_path(path, buffer, length);
+	if (IS_ERR(p))
+		return NULL;
+
+	len = buffer + length - p;
+	entry = kmalloc(sizeof(*entry) + len, GFP_ATOMIC);
+	if (unlikely(entry == NULL))
+		return p;
+
+	entry->inode = inode;
+	entry->generation = inode->i_generation;
+	entry->mnt = path->mnt;
+	entry->dentry = path->dentry;
+	entry->parent = parent;
+	entry->name_hash = name_hash;
+	entry->expires = jiffies + EXE_PATH_CACHE_TTL;
+	entry->len = len;
+	memcpy(entry->path, p, len);
+
+	/* xchg is a full barrier: the entry is complete before being visible */
+	old = xchg(&exe_path_cache[slot], entry);
+	if (old != NULL)
+		kfree_rcu(old, rcu);
+	return p;
+}
+
+char *exe_path_get(struct mm_struct *mm, char *buffer, int length)
+{
+	struct file *exe_file;
+	char *p;
+
+	if (unlikely(mm == NULL))
+		return NULL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+	exe_file = get_mm_exe_file(mm);
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 1, 0) */
+	if (!down_read_trylock(&mm->mmap_sem)) {
+		/* It's lock, we can't sleep here to get it, so just give up */
+		return NULL;
+	}
+	exe_file = mm->exe_file;
+	if (exe_file != NULL)
+		get_file(exe_file);
+	up_read(&mm->mmap_sem);
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(4, 1, 0) */
+
+	if (unlikely(exe_file == NULL))
+		return NULL;
+
+	p = file_path_get(exe_file, buffer, length);
+	fput(exe_file);
+	return p;
+}
+
+void exe_path_cache_destroy(void)
+{
+	struct exe_path_entry *entry;
+	int i;
+
+	for (i = 0; i < EXE_PATH_CACHE_SIZE; ++i) {
+		entry = xchg(&exe_path_cache[i], NULL);
+		if (entry != NULL)
+			kfree_rcu(entry, rcu);
+	}
+}
@@ -0,0 +1,18 @@
+#ifndef __TOOL_EXE_PATH_CACHE__
+#define __TOOL_EXE_PATH_CACHE__
+
+#include <linux/fs.h>
+#include <linux/mm.h>
+
+/* Resolve the path of an opened file, using the cache when possible.
+ * Returns a pointer inside buffer, or NULL if the path can't be resolved */
+char *file_path_get(struct file *file, char *buffer, int length);
+
+/* Resolve the path of the executable of mm, without taking mmap_sem on
+ * kernels where mm->exe_file is RCU protected */
+char *exe_path_get(struct mm_struct *mm, char *buffer, int length);
+
+/* Free the cache, the probes using it must be unplanted first */
+void exe_path_cache_destroy(void);
+
+#endif /* __TOOL_EXE_PATH_CACHE__ */
@@ -1,13 +1,25 @@
 #include <linux/version.h>
 #include <linux/err.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include "sparse_compat.h"
 
-/* Lock on the whitelist */
-static DEFINE_RWLOCK(whitelist_rwlock);
+/* Whitelist as published to the probes: the rows as configured, in
+ * order to print them back, and the index built from them by the module.
+ * Readers only take rcu_read_lock(), a new whitelist replaces the whole
+ * structure and the old one is freed after a grace period. */
+struct whitelist {
+	struct rcu_head rcu;
+	struct white_process *rows;
+	struct whitelist_index index;
+};
+
+static struct whitelist *whitelist = NULL;
 
-/* Sanity lock on the whitelist: only one w modification at a time ! */
+/* Sanity lock on the whitelist: only one w modification at a time !
+ * The new whitelist is built before taking it, only the swap is done
+ * under it */
 static DEFINE_SPINLOCK(whitelist_sanitylock);
 
 #ifdef ALSOROOT
@@ -16,7 +28,7 @@ static bool also_root;
 #endif /* ALSOROOT */
 
 static void
-purge_whitelist(struct white_process *head) __must_hold(whitelist_sanitylock)
+purge_whitelist(struct white_process *head)
 {
 	struct white_process *next_row;
 	struct white_process *current_row = head;
@@ -28,28 +40,43 @@ purge_whitelist(struct white_process *head) __must_hold(whitelist_sanitylock)
 	}
 }
 
+static void
+free_whitelist_rcu(struct rcu_head *rcu)
+{
+	struct whitelist *old = container_of(rcu, struct whitelist, rcu);
+
+	whitelist_index_destroy(&old->index);
+	purge_whitelist(old->rows);
+	kfree(old);
+}
+
+static void
+replace_whitelist(struct whitelist *new) __must_hold(whitelist_sanitylock)
+{
+	struct whitelist *old;
+
+	old = whitelist;
+	rcu_assign_pointer(whitelist, new);
+	if (old != NULL)
+		call_rcu(&old->rcu, free_whitelist_rcu);
+}
+
 void
 destroy_whitelist(void)
 {
 	unsigned long flags;
-	struct white_process *old;
 
 	spin_lock_irqsave(&whitelist_sanitylock, flags);
-
-	write_lock(&whitelist_rwlock);
-	old = whitelist;
-	whitelist = NULL;
-	write_unlock(&whitelist_rwlock);
-
+	replace_whitelist(NULL);
 	pr_info("[+] Whitelist cleared\n");
-
-	purge_whitelist(old);
-
 	spin_unlock_irqrestore(&whitelist_sanitylock, flags);
+
+	/* free_whitelist_rcu must not run once the module is gone */
+	rcu_barrier();
 }
 
 static struct white_process *
-add_whiterow(struct white_process **head, struct white_process *last, char *raw) __must_hold(whitelist_sanitylock)
+add_whiterow(struct white_process **head, struct white_process *last, char *raw)
 {
 	struct white_process *new_row;
 	if (raw == NULL)
@@ -86,33 +113,46 @@ whitelist_param_set(const char *buf, const struct kernel_param *kp)
 	char *raw_orig;
 	char *raw;
 	unsigned long flags;
-	struct white_process *old;
+	struct whitelist *new = NULL;
 	struct white_process *last = NULL;
 	struct white_process *head = NULL;
+	int ret = 0;
 
 	raw_orig = kstrdup(buf, GFP_KERNEL);
 	if (unlikely(raw_orig == NULL))
 		return 0;
 
-	spin_lock_irqsave(&whitelist_sanitylock, flags);
-
 	pr_info("[+] Creating new whitelist ...\n");
 
+	/* Parsed and indexed without the lock, the allocations may sleep */
 	while ((raw = strsep(&raw_orig, list_delims)) != NULL)
 		if (likely(*raw != '\0' && *raw != '\n'))
 			last = add_whiterow(&head, last, raw);
 
-	write_lock(&whitelist_rwlock);
-	old = whitelist;
-	whitelist = head;
-	write_unlock(&whitelist_rwlock);
+	if (head != NULL) {
+		new = kmalloc(sizeof(*new), GFP_KERNEL);
+		if (unlikely(new == NULL)) {
+			ret = -ENOMEM;
+		} else {
+			new->rows = head;
+			ret = whitelist_index_build(&new->index, head);
+			if (unlikely(ret != 0))
+				kfree(new);
+		}
+		if (unlikely(ret != 0)) {
+			pr_err("[-] Failed to build the new whitelist, keeping the previous one\n");
+			purge_whitelist(head);
+			goto out;
+		}
+	}
 
-	pr_info("[+] New whitelist applied\n");
-	purge_whitelist(old);
+	spin_lock_irqsave(&whitelist_sanitylock, flags);
+	replace_whitelist(new);
 	spin_unlock_irqrestore(&whitelist_sanitylock, flags);
-
+	pr_info("[+] New whitelist applied\n");
+out:
 	kfree(raw_orig);
-	return 0;
+	return ret;
 }
 
 #define VERIFY_SNPRINTF(buf, remaining, change)	\
@@ -136,16 +176,18 @@ static int
 whitelist_param_get(char *buffer, const struct kernel_param *kp)
 #endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(2, 6, 36) */
 {
+	struct whitelist *current_whitelist;
 	struct white_process *row;
 	char *last;
 	char *tmp;
 	/* fs/sysfs/file.c indicate that max size is PAGE_SIZE (minus trailing space) */
 	size_t available = PAGE_SIZE - 1;
 
-	read_lock(&whitelist_rwlock);
+	rcu_read_lock();
 
 	last = buffer;
-	row = whitelist;
+	current_whitelist = rcu_dereference(whitelist);
+	row = current_whitelist == NULL ? NULL : current_whitelist->rows;
 	while (row != NULL) {
 		tmp = whitelist_print(row, last, &available);
 		if (tmp == NULL) {
@@ -163,7 +205,7 @@ whitelist_param_get(char *buffer, const struct kernel_param *kp)
 		*last = '\0';
 	}
 done:
-	read_unlock(&whitelist_rwlock);
+	rcu_read_unlock();
 
 	/* last - buffer < PAGE_SIZE thus does not overflow int */
 	return (int)(last - buffer);
@@ -186,19 +228,20 @@ whitelist_root_param_set(const char *buf, const struct kernel_param *kp)
 # endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(2, 6, 36) */
 {
 	int ret;
+	bool value;
 
 	if (buf == NULL)
 		return -EBADF;
 
 	pr_info("[+] Modifying root whitelisting");
 
-	write_lock(&whitelist_rwlock);
-	ret = strtobool(buf, &also_root);
-	write_unlock(&whitelist_rwlock);
+	ret = strtobool(buf, &value);
+	if (ret == 0)
+		WRITE_ONCE(also_root, value);
 
 	if (ret != 0)
 		pr_info("[+] Invalid input");
-	else if (also_root)
+	else if (value)
 		pr_info("[+] Root actions are ignored like other");
 	else
 		pr_info("[+] Root actions are never ignored");
@@ -215,13 +258,7 @@ static int
 whitelist_root_param_get(char *buffer, const struct kernel_param *kp)
 # endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(2, 6, 36) */
 {
-	int ret;
-
-	read_lock(&whitelist_rwlock);
-	ret = sprintf(buffer, "%c", also_root ? 'Y' : 'N');
-	read_unlock(&whitelist_rwlock);
-
-	return ret;
+	return sprintf(buffer, "%c", READ_ONCE(also_root) ? 'Y' : 'N');
 }
 
 # if LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 36)
@@ -0,0 +1 @@
+../lib/exe_path_cache.c
\ No newline at end of file
@@ -0,0 +1 @@
+../lib/exe_path_cache.h
\ No newline at end of file
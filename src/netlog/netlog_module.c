@@ -10,6 +10,7 @@
 #include "probes.h"
 #include "internal.h"
 #include "netlog.h"
+#include "exe_path_cache.h"
 
 /****************************************************************/
 /* Kernel module information (submitted at the end of the file) */
@@ -75,6 +76,7 @@ static int __init netlog_init(void)
 	if (ret != 0) {
 		unplant_all();
 		destroy_whitelist();
+		exe_path_cache_destroy();
 	}
 
 	return ret;
@@ -88,6 +90,7 @@ static void __exit netlog_exit(void)
 {
 	unplant_all();
 	destroy_whitelist();
+	exe_path_cache_destroy();
 }
 
 
@@ -24,6 +24,7 @@
 #include "retro-compat.h"
 #include "internal.h"
 #include "probes_helper.h"
+#include "exe_path_cache.h"
 
 /********************************/
 /*          Variables           */
@@ -52,34 +53,13 @@ struct probes probe_list[] = {
 /*            Tools             */
 /********************************/
 
-static char *path_from_mm(struct mm_struct *mm, char *buffer, int length)
-{
-	char *p = NULL;
-	if (unlikely(mm == NULL))
-		return NULL;
-
-	if (!down_read_trylock(&mm->mmap_sem)) {
-		/* It's lock, we can't sleep here to get it, so just give up */
-		return NULL;
-	}
-
-	if (unlikely(mm->exe_file == NULL)) {
-		p = NULL;
-	} else {
-		p = d_path(&mm->exe_file->f_path, buffer, length);
-		if (IS_ERR(p))
-			p = NULL;
-	}
-
-	up_read(&mm->mmap_sem);
-	return p;
-}
-
 static const char *default_exec_name = "@Unknown";
+/* Sockets released by a kernel thread, see pre_inet_release */
+static const char *kernel_exec_name = "@Kernel";
 
-static void log_if_not_whitelisted(struct socket *sock, u8 protocol, u8 action)
+static void log_if_not_whitelisted(struct sock *sk, u8 protocol, u8 action)
 {
-	/* sock & sock->sk need to be non null */
+	/* sk needs to be non null */
 
 	char buffer[MAX_EXEC_PATH + 1];
 	const char *path;
@@ -93,35 +73,39 @@ static void log_if_not_whitelisted(struct socket *sock, u8 protocol, u8 action)
 	struct current_details details;
 #endif /* USE_PRINK */
 
-	path = path_from_mm(current->mm, buffer, MAX_EXEC_PATH);
-	buffer[MAX_EXEC_PATH] = '\0';
-	if (unlikely(path == NULL))
-		path = default_exec_name;
+	if (unlikely(current->flags & PF_KTHREAD)) {
+		path = kernel_exec_name;
+	} else {
+		path = exe_path_get(current->mm, buffer, MAX_EXEC_PATH);
+		buffer[MAX_EXEC_PATH] = '\0';
+		if (unlikely(path == NULL))
+			path = default_exec_name;
+	}
 
 	/* Get everything */
-	family = sock->sk->sk_family;
-	dst_port = ntohs(inet_sk(sock->sk)->DPORT);
-	src_port = ntohs(inet_sk(sock->sk)->SPORT);
+	family = sk->sk_family;
+	dst_port = ntohs(inet_sk(sk)->DPORT);
+	src_port = ntohs(inet_sk(sk)->SPORT);
 	switch (family) {
 	case AF_INET:
-		dst_ip = &inet_sk(sock->sk)->DADDR;
-		src_ip = &inet_sk(sock->sk)->SADDR;
+		dst_ip = &inet_sk(sk)->DADDR;
+		src_ip = &inet_sk(sk)->SADDR;
 		break;
 	case AF_INET6:
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
-		dst_ip = &sock->sk->sk_v6_daddr;
+		dst_ip = &sk->sk_v6_daddr;
 #else /* LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0) */
 # ifdef RHEL_MAJOR
 #  if RHEL_MAJOR >= 7
-		dst_ip = &sock->sk->sk_v6_daddr;
+		dst_ip = &sk->sk_v6_daddr;
 #  else /* RHEL_MAJOR < 7 */
-		dst_ip = &inet6_sk(sock->sk)->daddr;
+		dst_ip = &inet6_sk(sk)->daddr;
 #  endif /* RHEL_MAJOR ? 7 */
 # else /* !RHEL_MAJOR */
-		dst_ip = &inet6_sk(sock->sk)->daddr;
+		dst_ip = &inet6_sk(sk)->daddr;
 # endif /* ?RHEL_MAJOR */
 #endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(3, 13, 0) */
-		src_ip = &inet6_sk(sock->sk)->saddr;
+		src_ip = &inet6_sk(sk)->saddr;
 		break;
 	default:
 		dst_ip = NULL;
@@ -179,7 +163,7 @@ static int post_inet_stream_connect(struct kretprobe_instance *ri, struct pt_reg
 	    likely(sock->sk->sk_family == AF_INET ||
 		   sock->sk->sk_family == AF_INET6) &&
 	    likely(sock->sk->sk_protocol == IPPROTO_TCP))
-		log_if_not_whitelisted(sock, PROTO_TCP, ACTION_CONNECT);
+		log_if_not_whitelisted(sock->sk, PROTO_TCP, ACTION_CONNECT);
 
 	return 0;
 }
@@ -195,99 +179,108 @@ static int post_inet_dgram_connect(struct kretprobe_instance *ri, struct pt_regs
 	    likely(sock->sk->sk_family == AF_INET ||
 		   sock->sk->sk_family == AF_INET6) &&
 	    likely(sock->sk->sk_protocol == IPPROTO_UDP))
-		log_if_not_whitelisted(sock, PROTO_UDP, ACTION_CONNECT);
+		log_if_not_whitelisted(sock->sk, PROTO_UDP, ACTION_CONNECT);
 
 	return 0;
 }
 
-/* post_sys_accept probe is called right after the accept system call returns.
- * In the return register is placed the socket file descriptor. So with the
- * user of regs_register_status we can get the socket file descriptor and log
- * the data that we want for the socket.
+/* inet_csk_accept returns the new connection, as a struct sock not yet
+ * attached to any socket nor fd. Its first argument is the listening
+ * socket, which tells us if the call comes from userspace: sockets
+ * created by the kernel itself have no file.
  */
 
-static int post_sys_accept(struct kretprobe_instance *ri, struct pt_regs *regs)
+static int pre_inet_csk_accept(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
-	struct socket *sock;
-	int err;
-
-	/* sys_accept/sys_accept4 always return an int */
-	sock = sockfd_lookup((int)regs_return_value(regs), &err);
-
-	if (likely(sock != NULL)) {
-		if (likely(sock->sk != NULL) &&
-		    likely(sock->sk->sk_family == AF_INET ||
-			   sock->sk->sk_family == AF_INET6) &&
-		    likely(sock->sk->sk_protocol == IPPROTO_TCP))
-			log_if_not_whitelisted(sock, PROTO_TCP, ACTION_ACCEPT);
-		sockfd_put(sock);
-	}
+	struct sock *sk = (struct sock *)GET_ARG_1(regs);
+
+	if (likely(current != NULL) &&
+	    likely(sk != NULL) &&
+	    likely(sk->sk_socket != NULL) &&
+	    likely(sk->sk_socket->file != NULL))
+		return 0;
+	return 1;
+}
+
+static int post_inet_csk_accept(struct kretprobe_instance *ri, struct pt_regs *regs)
+{
+	struct sock *sk = (struct sock *)regs_return_value(regs);
+
+	/* NULL on failure */
+	if (likely(sk != NULL) &&
+	    likely(sk->sk_family == AF_INET ||
+		   sk->sk_family == AF_INET6) &&
+	    likely(sk->sk_protocol == IPPROTO_TCP))
+		log_if_not_whitelisted(sk, PROTO_TCP, ACTION_ACCEPT);
 	return 0;
 }
 
 
-static int pre_sys_close(struct kprobe *p, struct pt_regs *regs)
-{
-	struct socket *sock;
-	int fd, err;
+/* pre_inet_release probe is called when the last reference to an inet
+ * socket (IPv4 or IPv6, inet6_release calling inet_release) goes away:
+ * explicit close, but also process exit. Unlike sys_close, it is never
+ * called for files, pipes or any other kind of fd.
+ * The close is attributed to the task dropping that last reference, which
+ * is not always the one which called close(): another process sharing the
+ * socket (fork, SCM_RIGHTS), the exiting process whose memory is already
+ * gone ("@Unknown" path) or a kernel thread when the release is deferred
+ * ("@Kernel" path).
+ */
 
-	fd = (int) GET_ARG_1(regs);
-	sock = sockfd_lookup(fd, &err);
+static int pre_inet_release(struct kprobe *p, struct pt_regs *regs)
+{
+	struct socket *sock = (struct socket *)GET_ARG_1(regs);
 
+	/* Sockets created by the kernel itself have no file */
 	if (unlikely(current == NULL) ||
 	    unlikely(sock == NULL) ||
+	    unlikely(sock->file == NULL) ||
 	    unlikely(sock->sk == NULL) ||
-	    likely(sock->sk->sk_family != AF_INET &&
-		   sock->sk->sk_family != AF_INET6))
-		goto out;
+	    unlikely(sock->sk->sk_family != AF_INET &&
+		     sock->sk->sk_family != AF_INET6))
+		return 0;
 
 	if ((loaded_probes & (1 << PROBE_TCP_CLOSE)) &&
 	    sock->sk->sk_protocol == IPPROTO_TCP &&
 	    likely(inet_sk(sock->sk)->DPORT != 0))
-		log_if_not_whitelisted(sock, PROTO_TCP, ACTION_CLOSE);
+		log_if_not_whitelisted(sock->sk, PROTO_TCP, ACTION_CLOSE);
 	else if ((loaded_probes & (1 << PROBE_UDP_CLOSE)) &&
 		 sock->sk->sk_protocol == IPPROTO_UDP &&
 		 inet_sk(sock->sk)->SPORT != 0)
-		log_if_not_whitelisted(sock, PROTO_UDP, ACTION_CLOSE);
+		log_if_not_whitelisted(sock->sk, PROTO_UDP, ACTION_CLOSE);
 
-out:
-	if (likely(sock != NULL))
-		sockfd_put(sock);
 	return 0;
 }
 
-static int pre_sys_bind(struct kretprobe_instance *ri, struct pt_regs *regs)
+/* inet_bind and inet6_bind receive the socket directly, only the
+ * successful binds of userspace sockets are logged */
+
+static int pre_inet_bind(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
-	int err;
 	struct probe_data *priv = (struct probe_data*)ri->data;
-	struct socket *sock;
+	struct socket *sock = (struct socket *)GET_ARG_1(regs);
 
-	if (unlikely(current == NULL))
-		return 1;
-
-	sock = sockfd_lookup((int)GET_ARG_1(regs), &err);
-
-	if (likely(sock != NULL)) {
+	if (likely(current != NULL) &&
+	    likely(sock != NULL) &&
+	    likely(sock->file != NULL)) {
 		priv->sock = sock;
 		return 0;
 	}
-
 	return 1;
 }
 
-static int post_sys_bind(struct kretprobe_instance *ri, struct pt_regs *regs)
+static int post_inet_bind(struct kretprobe_instance *ri, struct pt_regs *regs)
 {
 	struct probe_data *priv = (struct probe_data*)ri->data;
 	struct socket *sock = priv->sock;
 
-	if (likely(sock != NULL)) {
-		if (likely(sock->sk != NULL) &&
-		    likely(sock->sk->sk_family == AF_INET ||
-			   sock->sk->sk_family == AF_INET6) &&
-		    likely(sock->sk->sk_protocol == IPPROTO_UDP))
-			log_if_not_whitelisted(sock, PROTO_UDP, ACTION_BIND);
-		sockfd_put(sock);
-	}
+	/* inet_bind and inet6_bind always return an int */
+	if (likely((int)regs_return_value(regs) == 0) &&
+	    likely(sock->sk != NULL) &&
+	    likely(sock->sk->sk_family == AF_INET ||
+		   sock->sk->sk_family == AF_INET6) &&
+	    likely(sock->sk->sk_protocol == IPPROTO_UDP))
+		log_if_not_whitelisted(sock->sk, PROTO_UDP, ACTION_BIND);
 
 	return 0;
 }
@@ -321,31 +314,40 @@ static struct kretprobe dgram_connect_kretprobe = {
 };
 
 static struct kretprobe accept_kretprobe = {
-	.handler = post_sys_accept,
+	.entry_handler = pre_inet_csk_accept,
+	.handler = post_inet_csk_accept,
 	.maxactive = 16 * NR_CPUS,
 	.kp = {
-		#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 32)
-		.symbol_name = "sys_accept",
-		#else
-		.symbol_name = "sys_accept4",
-		#endif
+		.symbol_name = "inet_csk_accept",
 		.fault_handler = handler_fault,
 	},
 };
 
 static struct kprobe close_kprobe = {
-	.pre_handler = pre_sys_close,
-	.symbol_name = "sys_close",
+	.pre_handler = pre_inet_release,
+	.symbol_name = "inet_release",
 	.fault_handler = handler_fault,
 };
 
 static struct kretprobe bind_kretprobe = {
-	.entry_handler = pre_sys_bind,
-	.handler = post_sys_bind,
+	.entry_handler = pre_inet_bind,
+	.handler = post_inet_bind,
 	.data_size = sizeof(struct probe_data),
 	.maxactive = 16 * NR_CPUS,
 	.kp = {
-		.symbol_name = "sys_bind",
+		.symbol_name = "inet_bind",
+		.fault_handler = handler_fault,
+	},
+};
+
+/* IPv6 sockets don't go through inet_bind */
+static struct kretprobe bind6_kretprobe = {
+	.entry_handler = pre_inet_bind,
+	.handler = post_inet_bind,
+	.data_size = sizeof(struct probe_data),
+	.maxactive = 16 * NR_CPUS,
+	.kp = {
+		.symbol_name = "inet6_bind",
 		.fault_handler = handler_fault,
 	},
 };
@@ -374,8 +376,10 @@ __must_hold(probe_lock)
 	if (removed_probes & (1 << PROBE_UDP_CONNECT))
 		unplant_kretprobe(&dgram_connect_kretprobe);
 
-	if (removed_probes & (1 << PROBE_UDP_BIND))
+	if (removed_probes & (1 << PROBE_UDP_BIND)) {
 		unplant_kretprobe(&bind_kretprobe);
+		unplant_kretprobe(&bind6_kretprobe);
+	}
 }
 
 void unplant_all(void)
@@ -426,6 +430,11 @@ __must_hold(&probe_lock)
 		err = plant_kretprobe(&bind_kretprobe);
 		if (err < 0)
 			return -BIND_PROBE_FAILED;
+		err = plant_kretprobe(&bind6_kretprobe);
+		if (err < 0) {
+			unplant_kretprobe(&bind_kretprobe);
+			return -BIND_PROBE_FAILED;
+		}
 		loaded_probes |= 1 << PROBE_UDP_BIND;
 	}
 
@@ -4,6 +4,10 @@
 #include <linux/version.h>
 #include <linux/inet.h>
 #include <linux/err.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
 #include <linux/spinlock.h>
 #include "whitelist.h"
 #include "netlog.h"
@@ -13,9 +17,16 @@
 
 #define IP_RAW_SIZE 16
 
+#define WHITELIST_HASH_MAX_BITS 16
+
 /* Whitelist */
 struct white_process {
 	struct white_process *next;
+	/** Index: next row with another path in the same bucket */
+	struct white_process *next_path;
+	/** Index: next row with the same path */
+	struct white_process *same_path;
+	u32 hash;
 	int port;
 	unsigned short family;
 	union {
@@ -27,16 +38,23 @@ struct white_process {
 	char path[];
 };
 
-static struct white_process *whitelist = NULL;
+/* Hash table on the path: each bucket links the first row of each path,
+ * which links the other rules (ports, ips) for the same path */
+struct whitelist_index {
+	u32 mask;
+	struct white_process **buckets;
+};
 
 static struct white_process* whiterow_from_string(char *str);
 static int is_already_whitelisted(struct white_process *head, struct white_process *new_row);
 static char * whitelist_print(struct white_process *row, char * buf, size_t *avail);
+static int whitelist_index_build(struct whitelist_index *index, struct white_process *rows);
+static void whitelist_index_destroy(struct whitelist_index *index);
 
 #include "whitelist_helper.c"
 
 static struct white_process*
-whiterow_from_string(char *str) __must_hold(whitelist_sanitylock)
+whiterow_from_string(char *str)
 {
 	struct white_process *new_row = NULL;
 	char *pos;
@@ -56,12 +74,14 @@ whiterow_from_string(char *str) __must_hold(whitelist_sanitylock)
 		return NULL;
 
 	/* Allocate new memory */
-	new_row = kmalloc(sizeof(struct white_process) + len + 1, GFP_ATOMIC);
+	new_row = kmalloc(sizeof(struct white_process) + len + 1, GFP_KERNEL);
 	if (unlikely(new_row == NULL))
 		return NULL;
 
 	/* Initialize */
 	new_row->next = NULL;
+	new_row->next_path = NULL;
+	new_row->same_path = NULL;
 	new_row->port = NO_PORT;
 	memset(new_row->ip.raw, 0, IP_RAW_SIZE);
 	new_row->family = AF_UNSPEC;
@@ -70,6 +90,7 @@ whiterow_from_string(char *str) __must_hold(whitelist_sanitylock)
 	memcpy(new_row->path, str, len);
 	new_row->path_len = len;
 	new_row->path[len] = '\0';
+	new_row->hash = jhash(new_row->path, len, 0);
 
 	/* Try to extact the next field */
 	while (*pos == FIELD_SEPARATOR) {
@@ -120,7 +141,7 @@ fail:
 }
 
 static int
-is_already_whitelisted(struct white_process *head, struct white_process *new_row) __must_hold(whitelist_sanitylock)
+is_already_whitelisted(struct white_process *head, struct white_process *new_row)
 {
 	struct white_process *row = head;
 
@@ -136,11 +157,53 @@ is_already_whitelisted(struct white_process *head, struct white_process *new_row
 	return 0;
 }
 
+static int
+whitelist_index_build(struct whitelist_index *index, struct white_process *rows)
+{
+	struct white_process *row, *first, **bucket;
+	unsigned long count = 0;
+	unsigned int bits;
+
+	for (row = rows; row != NULL; row = row->next)
+		++count;
+
+	/* About one path per bucket, whatever the number of rules */
+	bits = min_t(unsigned int, order_base_2(count), WHITELIST_HASH_MAX_BITS);
+	index->mask = (1U << bits) - 1;
+	index->buckets = kcalloc(1UL << bits, sizeof(*index->buckets), GFP_KERNEL);
+	if (unlikely(index->buckets == NULL))
+		return -ENOMEM;
+
+	for (row = rows; row != NULL; row = row->next) {
+		bucket = &index->buckets[row->hash & index->mask];
+		for (first = *bucket; first != NULL; first = first->next_path)
+			if (first->hash == row->hash &&
+			    first->path_len == row->path_len &&
+			    memcmp(first->path, row->path, row->path_len) == 0)
+				break;
+		if (first != NULL) {
+			row->same_path = first->same_path;
+			first->same_path = row;
+		} else {
+			row->next_path = *bucket;
+			*bucket = row;
+		}
+	}
+	return 0;
+}
+
+static void
+whitelist_index_destroy(struct whitelist_index *index)
+{
+	kfree(index->buckets);
+}
+
 int
 is_whitelisted(const char *path, unsigned short family, const void *ip, int port)
 {
 	size_t path_len;
-	unsigned long flags;
+	u32 hash;
+	struct whitelist *current_whitelist;
 	struct white_process *row;
 
 	path_len = strnlen(path, MAX_EXEC_PATH);
@@ -150,14 +213,27 @@ is_whitelisted(const char *path, unsigned short family, const void *ip, int port
 	    unlikely(path_len == MAX_EXEC_PATH))
 		return NOT_WHITELISTED;
 
+	hash = jhash(path, path_len, 0);
+
 	/*Check if the execution path and the ip and port are whitelisted*/
 
-	read_lock_irqsave(&whitelist_rwlock, flags);
+	rcu_read_lock();
+
+	current_whitelist = rcu_dereference(whitelist);
+	if (current_whitelist == NULL)
+		goto not_whitelisted;
 
-	row = whitelist;
+	/* Find the rules for this path */
+	row = current_whitelist->index.buckets[hash & current_whitelist->index.mask];
 	while (row != NULL) {
-		if ((row->port == NO_PORT || row->port == port) &&
-		    row->path_len == path_len && (memcmp(row->path, path, path_len) == 0)) {
+		if (row->hash == hash && row->path_len == path_len &&
+		    (memcmp(row->path, path, path_len) == 0))
+			break;
+		row = row->next_path;
+	}
+
+	while (row != NULL) {
+		if (row->port == NO_PORT || row->port == port) {
 			if (row->family == AF_UNSPEC)
 				goto whitelisted;
 			if (row->family == family) {
@@ -175,22 +251,23 @@ is_whitelisted(const char *path, unsigned short family, const void *ip, int port
 				}
 			}
 		}
-		row = row->next;
+		row = row->same_path;
 	}
 
-	read_unlock_irqrestore(&whitelist_rwlock, flags);
+not_whitelisted:
+	rcu_read_unlock();
 
 	return NOT_WHITELISTED;
 
 whitelisted:
-	read_unlock_irqrestore(&whitelist_rwlock, flags);
+	rcu_read_unlock();
 
 	return WHITELISTED;
 }
 
 static char *
 whitelist_print(struct white_process *row, char * buf, size_t *avail)
-__must_hold(whitelist_rwlock)
+__must_hold(RCU)
 {
 	int ret;
 	size_t rem = *avail;
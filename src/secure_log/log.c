@@ -1,10 +1,24 @@
 #include <linux/fs.h>
+#include <linux/bitmap.h>
 #include <linux/cdev.h>
+#include <linux/debugfs.h>
 #include <linux/in.h>
 #include <linux/ipv6.h>
+#include <linux/jhash.h>
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+#include <linux/lz4.h>
+#endif /* CONFIG_LZ4_COMPRESS && CONFIG_LZ4_DECOMPRESS */
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 #include "log.h"
+#include "secure_log_uapi.h"
 #include "sparse_compat.h"
 #include "current_details.h"
 
@@ -21,6 +35,38 @@ static int send_eof;
 module_param(send_eof, int, 0664);
 MODULE_PARM_DESC(send_eof, "Return a EOF at the current end of the buffer, only valid for new open call on the device");
 
+static int binary_format;
+module_param(binary_format, int, 0664);
+MODULE_PARM_DESC(binary_format, "Use a compact binary format instead of text (see secure_log_uapi.h), only valid for new open call on the device");
+
+static int octet_counting;
+module_param(octet_counting, int, 0664);
+MODULE_PARM_DESC(octet_counting, "Frame text records with their length (RFC 6587 octet-counting) instead of a trailing newline, only valid for new open call on the device");
+
+static int per_cpu_buffers;
+module_param(per_cpu_buffers, int, 0444);
+MODULE_PARM_DESC(per_cpu_buffers, "Use one lock-free buffer per CPU instead of a single shared one, only valid at load time");
+
+static unsigned int cold_size;
+module_param(cold_size, uint, 0444);
+MODULE_PARM_DESC(cold_size, "Memory (in bytes) used to keep LZ4-compressed copies of the records after they are overwritten, 0 to disable, only valid at load time");
+
+static int per_type_buffers;
+module_param(per_type_buffers, int, 0444);
+MODULE_PARM_DESC(per_type_buffers, "Use separate buffers for each type of record, also readable from /dev/"MODULE_NAME"_<type>, only valid at load time");
+
+static unsigned int coalesce_ms;
+module_param(coalesce_ms, uint, 0644);
+MODULE_PARM_DESC(coalesce_ms, "Count the records identical to the previous one (but for the time and pids) within that many milliseconds instead of storing them, 0 to disable");
+
+static int intern_paths;
+module_param(intern_paths, int, 0644);
+MODULE_PARM_DESC(intern_paths, "Store the paths of the executables of netlog records once, in a table, instead of in every record");
+
+static int lock_stats;
+module_param(lock_stats, int, 0644);
+MODULE_PARM_DESC(lock_stats, "Measure how long producers wait for and hold the buffer lock, see the stats file in debugfs");
+
 
 /*
  * This kernel module is heavily inspired from linux/kernel/printk.c
@@ -45,8 +91,12 @@ MODULE_PARM_DESC(send_eof, "Return a EOF at the current end of the buffer, only
 /* Log structures of records stored the buffer */
 struct sec_log {
 	size_t len /** Total size of the record, including the strings at the end */;
+	u64 seq /** Global sequence number of the record, used to merge the per-CPU buffers */;
 	struct current_details process /* Details of the process */;
 	enum secure_log_type type /** Type of this record (for cast)*/;
+	u32 committed /** Set once the record is completely written, see log_commit */;
+	u32 repeat /** Number of identical records coalesced into this one, see log_coalesce */;
+	u64 repeat_nsec /** Timestamp of the last of them */;
 };
 
 struct netlog_log {
@@ -57,6 +107,7 @@ struct netlog_log {
 	unsigned short family    /** Familly of the socket used (currently supported: AF_INET, AF_INET6 */;
 	int src_port             /** Source port (local) */;
 	int dst_port             /** Destination port (distant) */;
+	u32 path_id              /** Interned path (see log_path_intern), 0 if the path follows the record */;
 	union {
 		struct in_addr ip4;
 		struct in6_addr ip6;
@@ -75,35 +126,159 @@ struct execlog_log {
 	size_t argv_len       /** Length of the arguments given to the executable including the tailing '\0'. The string is accessible via get_netlog_argv. MUST be set after the 'path_len' */;
 };
 
+/* Synthetic record telling a reader that it lost some records */
+struct gap_log {
+	struct sec_log header /** Mandatory header, only the timestamp is set (to until_nsec) */;
+	u64 lost[LOG_NR_TYPES] /** Number of records lost, per type */;
+	u64 after_nsec        /** Timestamp of the last record read before them, 0 if unknown */;
+	u64 until_nsec        /** Timestamp of the last record lost */;
+};
+
+/* Synthetic record defining an interned path, only generated when reading
+ * in binary format */
+struct path_log {
+	struct sec_log header /** Mandatory header, only the timestamp is set */;
+	const struct log_path *path /** See log_path_intern */;
+};
+
 /* The bigger structure is definitely the netlog_log one */
 #define LOG_ALIGN __alignof__(struct netlog_log)
 
-/* Buffer */
-static char log_buf[LOG_BUF_LEN];
-
-/* index and sequence number of the first record stored in the buffer
- * Note that there is no code to handle overflow of the sequence number
- * as it's 64bits and even at 16K logs per second, it would need 30
- * million years of constant running to overflow
+/*
+ * Sparse index of a buffer: one entry every LOG_INDEX_STEP records, used to
+ * seek without walking through the whole buffer. Entries are stored in a
+ * circular array large enough to cover the whole buffer, as records are at
+ * least sizeof(struct sec_log) long.
  */
-static u64 log_first_seq = 0;
-static u32 log_first_idx = 0;
+#define LOG_INDEX_SHIFT 6
+#define LOG_INDEX_STEP (1 << LOG_INDEX_SHIFT)
+#define LOG_INDEX_INVALID (~0ULL)
 
-/* index and sequence number of the next record to store in the buffer
- * Note that there is no code to handle overflow of the sequence number
- * as it's 64bits and even at 16K logs per second, it would need 30
- * million years of constant running to overflow
- */
-static u64 log_next_seq = 0;
-static u32 log_next_idx = 0;
+/* Invalid sequence number inside a buffer */
+#define LOG_SEQ_NONE (~0ULL)
+
+struct log_index_entry {
+	u64 seq  /** Sequence number of the record in the buffer, LOG_INDEX_INVALID while being written */;
+	u64 gseq /** Global sequence number of the record */;
+	u64 nsec /** Timestamp of the reservation of the record */;
+	u32 idx  /** Index of the record */;
+	u64 count[LOG_NR_TYPES] /** Number of records of each type before this one */;
+};
+
+/* Buffer of records */
+struct log_ring {
+	char *buf /** Records, 'size' bytes. Replaced by log_resize, freed after a RCU grace period */;
+	u32 size /** Size of buf */;
+	u32 generation /** Incremented each time buf is replaced */;
+	int node /** NUMA node on which buf is allocated */;
+	struct log_index_entry *index /** Sparse index of buf, replaced with it */;
+	u32 index_len /** Number of entries in index, a power of 2 */;
+	/* Number of records of each type stored in the buffer since it was
+	 * created, and overwritten. They let readers know how many records
+	 * they lost. */
+	u64 stored[LOG_NR_TYPES];
+	u64 dropped[LOG_NR_TYPES];
+	u64 last_dropped_nsec /** Timestamp of the last overwritten record */;
+	/* index and sequence number of the first record stored in the buffer
+	 * Note that there is no code to handle overflow of the sequence number
+	 * as it's 64bits and even at 16K logs per second, it would need 30
+	 * million years of constant running to overflow
+	 */
+	u64 first_seq;
+	u32 first_idx;
+	/* index and sequence number of the next record to store in the buffer
+	 * Note that there is no code to handle overflow of the sequence number
+	 * as it's 64bits and even at 16K logs per second, it would need 30
+	 * million years of constant running to overflow
+	 */
+	u64 next_seq;
+	u32 next_idx;
+	u64 next_nsec /** Timestamp of the last record stored, see log_ring_clock */;
+	seqcount_t pos_seq /** Allow lockless readers to get a coherent view of the indexes and sequence numbers */;
+	struct secure_log_mmap_ring *mmap_pos /** Copy of the positions for mmap() readers */;
+	struct log_cold *cold /** Compressed copies of the oldest records, NULL unless cold_size is set */;
+	/* Last record stored, see log_coalesce */
+	u64 last_seq /** LOG_SEQ_NONE if it can't be coalesced with */;
+	u32 last_idx;
+	u32 last_hash;
+	/* Record counting the repetitions of the previous one, hidden from
+	 * the readers until another record is stored or until repeat_until */
+	u64 repeat_seq /** LOG_SEQ_NONE if none */;
+	u64 repeat_until;
+	int cpu /** CPU writing into the buffer, -1 if shared */;
+	/* Set while log_resize stops the producers, the records they drop
+	 * meanwhile are counted and reported by a gap record */
+	int resizing;
+	u64 resize_lost[LOG_NR_TYPES];
+};
+
+/* Buffers shared by all CPUs, used unless per_cpu_buffers is set. Only
+ * the first one is used unless per_type_buffers is set */
+static struct log_ring log_shared_ring[LOG_NR_TYPES];
 
-/* Buffer protection */
+/* Shared buffer protection */
 static DEFINE_SPINLOCK(log_lock);
 
+/* Per-CPU buffers: only written by their own CPU, with interrupts
+ * disabled, thus without any lock. Readers never block the producer,
+ * they check afterwards that what they copied was not overwritten.
+ */
+static DEFINE_PER_CPU(struct log_ring [LOG_NR_TYPES], log_cpu_ring);
+
+/* Next global sequence number, when using several buffers */
+static atomic64_t log_global_seq = ATOMIC64_INIT(0);
+
+/* Histograms: bucket N counts the values of N significant bits */
+#define LOG_HIST_BUCKETS 32
+
+/* Producer statistics, summed over all CPUs by log_stats_show */
+struct log_stats {
+	u64 stored[LOG_NR_TYPES] /** Records stored, per type */;
+	u64 bytes /** Size of the records stored */;
+	u64 coalesced /** Records only counted into the previous one, see log_coalesce */;
+	u64 truncated_paths;
+	u64 truncated_argv;
+	/* With lock_stats, in nanoseconds. Without a shared buffer, producers
+	 * don't wait and 'hold' is the time spent with interrupts disabled */
+	u64 lock_wait[LOG_HIST_BUCKETS];
+	u64 lock_hold[LOG_HIST_BUCKETS];
+	u64 lock_nsec /** When this CPU took the lock, 0 if not measured */;
+};
+
+static DEFINE_PER_CPU(struct log_stats, log_stats);
+
+/* Buffers in use: readers merge them by timestamp and sequence number */
+static struct log_ring **log_rings;
+static unsigned int log_nr_rings;
+
+/* Size of the buffers, can be changed at runtime, see log_resize */
+static unsigned int log_buf_len = LOG_BUF_LEN;
+
+/* Serialize resizes, and mmap() calls as the layout depends on the size */
+static DEFINE_MUTEX(log_resize_mutex);
+
+/* Records dropped during the last resize, see log_resize */
+static u64 log_resize_dropped;
+
+/* Header of the mmap() view, see secure_log_uapi.h */
+static struct secure_log_mmap_header *log_mmap_header;
+static size_t log_mmap_header_size;
+static unsigned long log_mmap_size /** Header and buffers, see log_mmap_layout */;
+
 /* Poll queue */
 static DECLARE_WAIT_QUEUE_HEAD(log_wait);
 
-static char first_read = 1;
+/* Records and bytes committed since the module was loaded */
+static atomic64_t log_committed_records = ATOMIC64_INIT(0);
+static atomic64_t log_committed_bytes = ATOMIC64_INIT(0);
+
+/* Producers only wake the readers up once these totals are reached, they
+ * are lowered by the waiting readers, see secure_log_wakeup_arm */
+#define LOG_WAKEUP_NEVER LLONG_MAX
+static atomic64_t log_wakeup_records = ATOMIC64_INIT(LOG_WAKEUP_NEVER);
+static atomic64_t log_wakeup_bytes = ATOMIC64_INIT(LOG_WAKEUP_NEVER);
+
+static int first_read = 1;
 
 /* Device identifiers */
 static struct device *dev;
@@ -117,38 +292,43 @@ static struct class *secure_class;
 /* Get the path of a log */
 static char *
 get_netlog_path(struct netlog_log *log)
-__must_hold(log_lock)
 {
 	return ((char *)log) + sizeof(struct netlog_log);
 }
 
 static char *
 get_execlog_path(struct execlog_log *log)
-__must_hold(log_lock)
 {
 	return ((char *)log) + sizeof(struct execlog_log);
 }
 
 static char *
 get_execlog_argv(struct execlog_log *log)
-__must_hold(log_lock)
 {
 	return ((char *)log) + sizeof(struct execlog_log) + log->path_len;
 }
 
 static u32
-next_record(u32 idx)
+next_record(struct log_ring *ring, u32 idx)
 __must_hold(log_lock)
 {
-	size_t *len;
+	struct sec_log *record;
 
-	len = &((struct sec_log *)(log_buf + idx))->len;
-	if (*len == 0) {
+	record = (struct sec_log *)(ring->buf + idx);
+	if (record->len == 0) {
 		/* We need to wrap around */
-		return 0;
+		record = (struct sec_log *)ring->buf;
+		idx = 0;
 	}
 	/* Length of items inside the cache can't get out of the cache */
-	return (u32)(idx + *len);
+	return (u32)(idx + record->len);
+}
+
+/* Account for 'value' in a histogram */
+static inline void
+log_hist_add(u64 *hist, u64 value)
+{
+	hist[min_t(unsigned int, fls64(value), LOG_HIST_BUCKETS - 1)]++;
 }
 
 /* Small tool */
@@ -167,30 +347,133 @@ copy_ip(void *dst, const void *src, unsigned short family)
 	}
 }
 
+/* Select and lock the buffer the current CPU should write a record of
+ * type 'type' into */
+static struct log_ring *
+log_ring_lock(enum secure_log_type type, unsigned long *flags)
+__acquires(log_lock)
+{
+	unsigned int i = per_type_buffers ? type : 0;
+	struct log_stats *stats;
+	struct log_ring *ring;
+	u64 start = 0;
+
+	if (unlikely(READ_ONCE(lock_stats)))
+		start = local_clock();
+
+	if (per_cpu_buffers) {
+		/* Nobody else writes into our buffer, just make sure that
+		 * we are not interrupted nor moved to another CPU */
+		local_irq_save(*flags);
+		__acquire(log_lock);
+		ring = this_cpu_ptr(&log_cpu_ring[i]);
+	} else {
+		spin_lock_irqsave(&log_lock, *flags);
+		ring = &log_shared_ring[i];
+	}
+
+	if (unlikely(start != 0)) {
+		/* We can't be moved to another CPU anymore */
+		stats = this_cpu_ptr(&log_stats);
+		stats->lock_nsec = local_clock();
+		log_hist_add(stats->lock_wait, stats->lock_nsec - start);
+	}
+	return ring;
+}
+
+static void
+log_ring_unlock(struct log_ring *ring, unsigned long flags)
+__releases(log_lock)
+{
+	struct log_stats *stats = this_cpu_ptr(&log_stats);
+
+	if (unlikely(stats->lock_nsec != 0)) {
+		log_hist_add(stats->lock_hold, local_clock() - stats->lock_nsec);
+		stats->lock_nsec = 0;
+	}
+
+	if (per_cpu_buffers) {
+		__release(log_lock);
+		local_irq_restore(flags);
+	} else {
+		spin_unlock_irqrestore(&log_lock, flags);
+	}
+}
+
+/*
+ * Updates of the positions of a buffer: both the in-kernel readers and
+ * the mmap() ones must see them change atomically
+ */
+static inline void
+log_ring_pos_begin(struct log_ring *ring)
+__must_hold(log_lock)
+{
+	struct secure_log_mmap_ring *pos = ring->mmap_pos;
+
+	write_seqcount_begin(&ring->pos_seq);
+	WRITE_ONCE(pos->lock, pos->lock + 1);
+	smp_wmb();
+}
+
 static inline void
-find_new_record_place(size_t size)
+log_ring_pos_end(struct log_ring *ring)
+__must_hold(log_lock)
+{
+	struct secure_log_mmap_ring *pos = ring->mmap_pos;
+
+	WRITE_ONCE(pos->first_seq, ring->first_seq);
+	WRITE_ONCE(pos->first_idx, ring->first_idx);
+	WRITE_ONCE(pos->next_seq, ring->next_seq);
+	WRITE_ONCE(pos->next_idx, ring->next_idx);
+	WRITE_ONCE(pos->generation, ring->generation);
+	smp_wmb();
+	WRITE_ONCE(pos->lock, pos->lock + 1);
+	write_seqcount_end(&ring->pos_seq);
+}
+
+static void log_cold_kick(struct log_ring *ring, u64 first_seq);
+
+static inline struct sec_log *
+find_new_record_place(struct log_ring *ring, size_t size)
 __must_hold(log_lock)
 {
-	// align size to next block
-	size += (-size) & (LOG_ALIGN - 1);
+	struct sec_log *record;
+	u64 first_seq = ring->first_seq;
+	u32 first_idx = ring->first_idx;
+	u32 next_idx = ring->next_idx;
+	u64 dropped[LOG_NR_TYPES] = { 0 };
+	u64 last_dropped_nsec = ring->last_dropped_nsec;
+	unsigned int type;
 
-	while (log_first_seq < log_next_seq) {
+	while (first_seq < ring->next_seq) {
 		size_t free;
 
-		if (log_next_idx > log_first_idx)
-			free = max(LOG_BUF_LEN - log_next_idx, log_first_idx);
+		if (next_idx > first_idx)
+			free = max(ring->size - next_idx, first_idx);
 		else
-			free = log_first_idx - log_next_idx;
+			free = first_idx - next_idx;
 
 		if (free > size + sizeof(struct sec_log))
 			break;
 
+		/* Never drop a record which is still being written */
+		record = (struct sec_log *)(ring->buf + first_idx);
+		if (record->len == 0)
+			record = (struct sec_log *)ring->buf;
+		if (unlikely(!READ_ONCE(record->committed)))
+			return NULL;
+
+		/* Keep track of it for the readers which did not read it */
+		if (likely(record->type < LOG_NR_TYPES))
+			dropped[record->type]++;
+		last_dropped_nsec = record->process.nsec;
+
 		/* Drop old messages until we have enough contiuous space */
-		log_first_idx = next_record(log_first_idx);
-		log_first_seq++;
+		first_idx = next_record(ring, first_idx);
+		first_seq++;
 	}
 
-	if (unlikely(log_next_idx + size + sizeof(struct sec_log) >= LOG_BUF_LEN)) {
+	if (unlikely(next_idx + size + sizeof(struct sec_log) >= ring->size)) {
 		/*
 		 * As free > size + sizeof(struct sec_log), this mean that we had
 		 * free = max(log_buf_len - log_next_idx, log_first_idx)
@@ -198,9 +481,482 @@ __must_hold(log_lock)
 		 * is log_first_idx, thus we must wrap around.
 		 * Add an empty size_t to indicate the wrap around
 		 */
-		*((size_t *)(log_buf + log_next_idx)) = 0;
-		log_next_idx = 0;
+		*((size_t *)(ring->buf + next_idx)) = 0;
+		next_idx = 0;
+	}
+
+	/* Records are overwritten, their copy must keep up */
+	if (ring->cold != NULL && first_seq != ring->first_seq)
+		log_cold_kick(ring, first_seq);
+
+	/* Readers must know about the dropped records before we start
+	 * overwriting them */
+	log_ring_pos_begin(ring);
+	ring->first_seq = first_seq;
+	ring->first_idx = first_idx;
+	ring->next_idx = next_idx;
+	for (type = 0; type < LOG_NR_TYPES; ++type)
+		ring->dropped[type] += dropped[type];
+	ring->last_dropped_nsec = last_dropped_nsec;
+	log_ring_pos_end(ring);
+
+	return (struct sec_log *)(ring->buf + next_idx);
+}
+
+/* Number of index entries needed by a 'size' bytes buffer */
+static inline u32
+log_index_len(unsigned int size)
+{
+	return roundup_pow_of_two(size / (LOG_INDEX_STEP * sizeof(struct sec_log)) + 1);
+}
+
+/* Is the record 'seq' of a buffer indexed ? */
+#define LOG_INDEXED(seq) (((seq) & (LOG_INDEX_STEP - 1)) == 0)
+
+/* Index the record 'seq' of a buffer */
+static inline void
+log_index_add(struct log_index_entry *index, u32 index_len, u64 seq,
+	      u64 gseq, u64 nsec, u32 idx, const u64 *count)
+{
+	struct log_index_entry *entry;
+
+	entry = &index[(seq >> LOG_INDEX_SHIFT) & (index_len - 1)];
+	/* Lockless readers check 'seq' before and after reading the entry */
+	WRITE_ONCE(entry->seq, LOG_INDEX_INVALID);
+	smp_wmb();
+	entry->gseq = gseq;
+	entry->nsec = nsec;
+	entry->idx = idx;
+	memcpy(entry->count, count, sizeof(entry->count));
+	smp_wmb();
+	WRITE_ONCE(entry->seq, seq);
+}
+
+/* Sequence number of the record being written at the end of the buffer */
+static inline u64
+log_record_seq(struct log_ring *ring)
+__must_hold(log_lock)
+{
+	if (per_cpu_buffers || per_type_buffers)
+		return (u64)atomic64_inc_return(&log_global_seq) - 1;
+	return ring->next_seq;
+}
+
+
+
+/*
+ * Interned paths (intern_paths): most netlog records come from a handful
+ * of executables. Their paths are stored once in this table and the
+ * records only keep their id, expanded by the readers. Ids are neither
+ * reused nor freed before the module is unloaded, as they may still be in
+ * the buffers, in the cold region or in the cache of mmap() readers: once
+ * the table is full, the paths are stored in the records again.
+ */
+#define LOG_PATHS_MAX 4096
+#define LOG_PATH_HASH_SIZE 1024
+
+struct log_path {
+	struct list_head list /** Entry in its log_path_hash bucket */;
+	u32 id;
+	u32 len /** Length of path, including the '\0' */;
+	char path[];
+};
+
+static struct list_head log_path_hash[LOG_PATH_HASH_SIZE];
+static struct log_path *log_paths[LOG_PATHS_MAX + 1] /** By id, 0 is never used */;
+static u32 log_nr_paths;
+static DEFINE_SPINLOCK(log_paths_lock);
+
+static struct log_path *
+log_path_find(struct list_head *head, const char *path, size_t len)
+{
+	struct log_path *entry;
+
+	list_for_each_entry_rcu(entry, head, list)
+		if (entry->len == len && !memcmp(entry->path, path, len))
+			return entry;
+	return NULL;
+}
+
+/* Id of 'path' ('len' bytes including the '\0'), 0 if it can't be interned */
+static u32
+log_path_intern(const char *path, size_t len)
+{
+	struct log_path *entry;
+	struct list_head *head;
+	unsigned long flags;
+	u32 id = 0;
+
+	if (len > SECURE_LOG_PATH_MAX || path[len - 1] != '\0')
+		return 0;
+	head = &log_path_hash[jhash(path, (u32)len, 0) & (LOG_PATH_HASH_SIZE - 1)];
+
+	rcu_read_lock();
+	entry = log_path_find(head, path, len);
+	if (entry != NULL)
+		id = entry->id;
+	rcu_read_unlock();
+	if (likely(id != 0) || READ_ONCE(log_nr_paths) >= LOG_PATHS_MAX)
+		return id;
+
+	/* First use, somebody else may be adding it too */
+	spin_lock_irqsave(&log_paths_lock, flags);
+	entry = log_path_find(head, path, len);
+	if (entry == NULL && log_nr_paths < LOG_PATHS_MAX) {
+		entry = kmalloc(sizeof(*entry) + len, GFP_ATOMIC);
+		if (entry != NULL) {
+			entry->id = log_nr_paths + 1;
+			entry->len = (u32)len;
+			memcpy(entry->path, path, len);
+			list_add_tail_rcu(&entry->list, head);
+			smp_wmb();
+			WRITE_ONCE(log_paths[entry->id], entry);
+			WRITE_ONCE(log_nr_paths, entry->id);
+		}
+	}
+	if (entry != NULL)
+		id = entry->id;
+	spin_unlock_irqrestore(&log_paths_lock, flags);
+	return id;
+}
+
+/* Interned path 'id', NULL if there is none */
+static struct log_path *
+log_path_get(u32 id)
+{
+	struct log_path *entry;
+
+	if (id == 0 || id > LOG_PATHS_MAX)
+		return NULL;
+	entry = READ_ONCE(log_paths[id]);
+	/* Pairs with log_path_intern */
+	smp_rmb();
+	return entry;
+}
+
+/* Put back the interned path of a netlog record copied by a reader, which
+ * has room for USER_BUFFER_SIZE bytes of strings */
+static void
+log_path_expand(struct sec_log *record)
+{
+	struct netlog_log *netlog = (struct netlog_log *)record;
+	struct log_path *entry;
+
+	if (record->type != LOG_NETWORK_INTERACTION ||
+	    record->len < sizeof(struct netlog_log) || netlog->path_id == 0)
+		return;
+	entry = log_path_get(netlog->path_id);
+	if (WARN_ON(entry == NULL))
+		return;
+	memcpy(get_netlog_path(netlog), entry->path, entry->len);
+	netlog->path_len = entry->len;
+	record->len = sizeof(struct netlog_log) + entry->len;
+}
+
+/*
+ * Coalescing (coalesce_ms): cron jobs, monitoring agents and shell loops
+ * store many records which only differ by their timestamp and process ids.
+ * A record identical to the last one of its buffer, and stored less than
+ * coalesce_ms after it, is written once and then held back from the
+ * readers while the next identical ones are only counted into it (repeat
+ * and repeat_nsec). It is released as soon as another record is stored in
+ * the buffer, or coalesce_ms after it was stored.
+ */
+enum log_coalesce_result {
+	LOG_STORE        /** Store the record */,
+	LOG_STORE_REPEAT /** Store the record and count the next identical ones into it */,
+	LOG_COALESCED    /** Counted into the last record, don't store it */,
+};
+
+/* Content of a record about to be stored */
+struct log_match {
+	u32 hash /** Of all the fields below */;
+	const struct current_details *process /** Only the user and group ids are compared */;
+	const struct netlog_log *netlog /** Netlog fields, NULL for other records */;
+	u32 path_id /** Interned path of netlog records, path_len is then 0 */;
+	const char *path;
+	size_t path_len;
+	const char *argv /** NULL for netlog records */;
+	size_t argv_len;
+};
+
+/* Wakes the readers up once the held back records are released */
+static struct timer_list log_repeat_timer;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+static void
+log_repeat_timer_fn(struct timer_list *timer)
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0) */
+static void
+log_repeat_timer_fn(unsigned long arg)
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(4, 15, 0) */
+{
+	wake_up_interruptible(&log_wait);
+}
+
+/* Prepare the comparison of a record, returns NULL if coalescing is off */
+static const struct log_match *
+log_match_init(struct log_match *match)
+{
+	const struct current_details *process = match->process;
+	const struct netlog_log *netlog = match->netlog;
+	u32 hash;
+
+	if (!READ_ONCE(coalesce_ms))
+		return NULL;
+
+	hash = jhash_3words(process->uid, process->gid, process->euid, 0);
+	hash = jhash_3words(process->egid, match->path_id,
+			    (u32)match->path_len, hash);
+	if (netlog != NULL) {
+		hash = jhash_3words(netlog->protocol, netlog->action,
+				    netlog->family, hash);
+		hash = jhash_2words((u32)netlog->src_port,
+				    (u32)netlog->dst_port, hash);
+		hash = jhash(netlog->src.raw, sizeof(netlog->src.raw), hash);
+		hash = jhash(netlog->dst.raw, sizeof(netlog->dst.raw), hash);
+	}
+	hash = jhash(match->path, (u32)match->path_len, hash);
+	if (match->argv != NULL)
+		hash = jhash(match->argv, (u32)match->argv_len, hash);
+	match->hash = hash;
+	return match;
+}
+
+/* Is the stored 'record' identical to the one described by 'match' ? */
+static bool
+log_match_record(const struct log_match *match, enum secure_log_type type,
+		 struct sec_log *record)
+{
+	const struct current_details *process = &record->process;
+	const struct netlog_log *fields = match->netlog;
+	struct netlog_log *netlog;
+	struct execlog_log *execlog;
+
+	if (record->type != type ||
+	    process->uid != match->process->uid ||
+	    process->gid != match->process->gid ||
+	    process->euid != match->process->euid ||
+	    process->egid != match->process->egid)
+		return false;
+
+	switch (type) {
+	case LOG_NETWORK_INTERACTION:
+		netlog = (struct netlog_log *)record;
+		return fields != NULL &&
+		       netlog->protocol == fields->protocol &&
+		       netlog->action == fields->action &&
+		       netlog->family == fields->family &&
+		       netlog->src_port == fields->src_port &&
+		       netlog->dst_port == fields->dst_port &&
+		       !memcmp(netlog->src.raw, fields->src.raw,
+			       sizeof(netlog->src.raw)) &&
+		       !memcmp(netlog->dst.raw, fields->dst.raw,
+			       sizeof(netlog->dst.raw)) &&
+		       netlog->path_id == match->path_id &&
+		       netlog->path_len == match->path_len &&
+		       !memcmp(get_netlog_path(netlog), match->path,
+			       match->path_len);
+	case LOG_EXECUTION:
+		execlog = (struct execlog_log *)record;
+		return match->argv != NULL &&
+		       execlog->path_len == match->path_len &&
+		       execlog->argv_len == match->argv_len &&
+		       !memcmp(get_execlog_path(execlog), match->path,
+			       match->path_len) &&
+		       !memcmp(get_execlog_argv(execlog), match->argv,
+			       match->argv_len);
+	default:
+		return false;
+	}
+}
+
+/*
+ * Timestamp of the record about to be stored. Records are in time order
+ * within a buffer, seeks by time and the merge of the buffers rely on it:
+ * local_clock() may go back a little between the CPUs sharing a buffer.
+ */
+static u64
+log_ring_clock(struct log_ring *ring)
+__must_hold(log_lock)
+{
+	ring->next_nsec = max(local_clock(), ring->next_nsec);
+	return ring->next_nsec;
+}
+
+/* Can the record described by 'match', stored at 'now', be coalesced with
+ * the last one ? */
+static enum log_coalesce_result
+log_coalesce(struct log_ring *ring, enum secure_log_type type,
+	     const struct log_match *match, u64 now)
+__must_hold(log_lock)
+{
+	struct sec_log *last;
+	u64 window = (u64)READ_ONCE(coalesce_ms) * NSEC_PER_MSEC;
+	u64 last_nsec;
+
+	if (ring->last_seq == LOG_SEQ_NONE ||
+	    ring->last_seq + 1 != ring->next_seq ||
+	    ring->last_seq < ring->first_seq ||
+	    ring->last_hash != match->hash)
+		return LOG_STORE;
+
+	/* Still being written, we can't compare it */
+	last = (struct sec_log *)(ring->buf + ring->last_idx);
+	if (!READ_ONCE(last->committed))
+		return LOG_STORE;
+	smp_rmb();
+	if (!log_match_record(match, type, last))
+		return LOG_STORE;
+
+	last_nsec = last->repeat ? last->repeat_nsec : last->process.nsec;
+	if (now > last_nsec && now - last_nsec >= window)
+		return LOG_STORE;
+	if (ring->repeat_seq != ring->last_seq || now >= ring->repeat_until)
+		return LOG_STORE_REPEAT;
+
+	/* Readers re-check the record if the positions moved meanwhile */
+	log_ring_pos_begin(ring);
+	WRITE_ONCE(last->repeat_nsec, max(last_nsec, now));
+	WRITE_ONCE(last->repeat, last->repeat + 1);
+	log_ring_pos_end(ring);
+	__this_cpu_inc(log_stats.coalesced);
+	return LOG_COALESCED;
+}
+
+
+/*
+ * Records are written in two steps:
+ *  - log_reserve takes the lock (or disable interrupts for per-CPU
+ *    buffers) just long enough to allocate the space and fill the
+ *    header used to walk the buffer;
+ *  - the caller then fills the record without any lock and calls
+ *    log_commit, which makes it available to readers.
+ * Readers stop at the first reserved record which is not yet committed,
+ * so that the output stays ordered. Preemption is disabled in between to
+ * keep this window short.
+ * The timestamp of the record is taken by log_reserve, under the lock: the
+ * caller must keep it.
+ */
+static struct sec_log *
+log_reserve(enum secure_log_type type, size_t size,
+	    const struct log_match *match)
+{
+	struct log_ring *ring;
+	struct sec_log *record;
+	unsigned long flags;
+	enum log_coalesce_result coalesce = LOG_STORE;
+	u64 now;
+
+	preempt_disable();
+	ring = log_ring_lock(type, &flags);
+
+	if (unlikely(READ_ONCE(ring->resizing))) {
+		/* The buffer is being moved, see log_resize */
+		ring->resize_lost[type]++;
+		log_ring_unlock(ring, flags);
+		preempt_enable();
+		return NULL;
+	}
+	/* Pairs with log_move_switch: see the new buffer once it's done */
+	smp_rmb();
+
+	now = log_ring_clock(ring);
+	if (match != NULL) {
+		coalesce = log_coalesce(ring, type, match, now);
+		if (coalesce == LOG_COALESCED) {
+			log_ring_unlock(ring, flags);
+			preempt_enable();
+			return NULL;
+		}
+	}
+
+	/* Only possible if the buffer was shrunk since the caller computed
+	 * the size limits */
+	if (unlikely(size + sizeof(struct sec_log) >= ring->size >> 1))
+		record = NULL;
+	else
+		record = find_new_record_place(ring, size);
+	if (likely(record != NULL)) {
+		record->len = size;
+		record->seq = log_record_seq(ring);
+		record->type = type;
+		record->committed = 0;
+		record->repeat = 0;
+		record->repeat_nsec = 0;
+		record->process.nsec = now;
+		if (LOG_INDEXED(ring->next_seq))
+			log_index_add(ring->index, ring->index_len,
+				      ring->next_seq, record->seq, now,
+				      (u32)((char *)record - ring->buf),
+				      ring->stored);
+
+		/* Reserve the space */
+		log_ring_pos_begin(ring);
+		if (match != NULL) {
+			ring->last_seq = ring->next_seq;
+			ring->last_idx = (u32)((char *)record - ring->buf);
+			ring->last_hash = match->hash;
+		} else {
+			ring->last_seq = LOG_SEQ_NONE;
+		}
+		/* This also releases the record held back until now */
+		if (coalesce == LOG_STORE_REPEAT) {
+			ring->repeat_seq = ring->next_seq;
+			ring->repeat_until = now +
+				(u64)READ_ONCE(coalesce_ms) * NSEC_PER_MSEC;
+		} else {
+			ring->repeat_seq = LOG_SEQ_NONE;
+		}
+		/* size can't be bigger than the buffer */
+		ring->next_idx += (u32)size;
+		ring->next_seq++;
+		ring->stored[type]++;
+		log_ring_pos_end(ring);
+		__this_cpu_inc(log_stats.stored[type]);
+		__this_cpu_add(log_stats.bytes, size);
+	}
+
+	log_ring_unlock(ring, flags);
+
+	/* Make sure that the readers get it once it's released */
+	if (coalesce == LOG_STORE_REPEAT && likely(record != NULL))
+		mod_timer(&log_repeat_timer,
+			  jiffies + msecs_to_jiffies(READ_ONCE(coalesce_ms)) + 1);
+
+	if (unlikely(record == NULL)) {
+		/* The whole buffer was filled while the oldest record was
+		 * being written, there is nothing we can do for this one */
+		preempt_enable();
+		dev_warn_ratelimited(dev, "Buffer full of uncommitted records, dropping one\n");
 	}
+	return record;
+}
+
+static void
+log_commit(struct sec_log *record)
+{
+	s64 records, bytes;
+	/* The record may be overwritten as soon as it's committed */
+	s64 len = (s64)record->len;
+
+	/* The content must be visible before the record is marked as such */
+	smp_wmb();
+	WRITE_ONCE(record->committed, 1);
+	preempt_enable();
+
+	/* Wake-up reading threads, only if one of them is waiting for this
+	 * record. The full barriers implied by the atomic operations pair
+	 * with the one in secure_log_wakeup_arm */
+	records = atomic64_inc_return(&log_committed_records);
+	bytes = atomic64_add_return(len, &log_committed_bytes);
+	if (records < atomic64_read(&log_wakeup_records) &&
+	    bytes < atomic64_read(&log_wakeup_bytes))
+		return;
+	/* Woken up readers arm the wake up again if they need it */
+	atomic64_set(&log_wakeup_records, LOG_WAKEUP_NEVER);
+	atomic64_set(&log_wakeup_bytes, LOG_WAKEUP_NEVER);
+	wake_up_interruptible(&log_wait);
 }
 
 
@@ -211,52 +967,72 @@ store_netlog_record(const char *path, enum netlog_action action,
 		    const void *dst_ip, int dst_port)
 {
 	struct netlog_log *record;
+	struct netlog_log fields = {
+		.protocol = protocol,
+		.action = action,
+		.family = family,
+		.src_port = src_port,
+		.dst_port = dst_port,
+	};
+	struct current_details process;
+	struct log_match match;
 	size_t path_len, record_size;
-	unsigned long flags;
+	u32 path_id = 0;
+	unsigned int buf_len = READ_ONCE(log_buf_len);
 
 	path_len = strlen(path) + 1;
-	if (unlikely(path_len > (LOG_BUF_LEN >> 4) ||
+	if (unlikely(path_len > (buf_len >> 4) ||
 		     path_len > INT_MAX)) {
 		dev_warn(dev, "troncating path (size %zu > %i)\n",
-			 path_len, min((LOG_BUF_LEN >> 4), (unsigned int)INT_MAX));
-		path_len = min((LOG_BUF_LEN >> 4), (unsigned int)INT_MAX);
+			 path_len, min((buf_len >> 4), (unsigned int)INT_MAX));
+		path_len = min((buf_len >> 4), (unsigned int)INT_MAX);
+		this_cpu_inc(log_stats.truncated_paths);
+	}
+	/* Only the id of an interned path is stored */
+	if (READ_ONCE(intern_paths)) {
+		path_id = log_path_intern(path, path_len);
+		if (path_id != 0)
+			path_len = 0;
 	}
-	record_size = sizeof(struct netlog_log) + path_len;
+	record_size = ALIGN(sizeof(struct netlog_log) + path_len, LOG_ALIGN);
 
-	spin_lock_irqsave(&log_lock, flags);
+	/* Gather everything first, to compare it with the previous record */
+	fill_current_details(&process);
+	if (src_ip != NULL)
+		copy_ip(fields.src.raw, src_ip, family);
+	if (dst_ip != NULL)
+		copy_ip(fields.dst.raw, dst_ip, family);
+	match.process = &process;
+	match.netlog = &fields;
+	match.path_id = path_id;
+	match.path = path;
+	match.path_len = path_len;
+	match.argv = NULL;
+	match.argv_len = 0;
 
-	find_new_record_place(record_size);
-	record = (struct netlog_log *)(log_buf + log_next_idx);
-	/* Store basic information */
-	fill_current_details(&(record->header.process));
-	record->header.type = LOG_NETWORK_INTERACTION;
-	record->header.len = record_size;
+	record = (struct netlog_log *)log_reserve(LOG_NETWORK_INTERACTION,
+						  record_size,
+						  log_match_init(&match));
+	if (unlikely(record == NULL))
+		return;
+
+	/* Store basic information, with the timestamp from log_reserve */
+	process.nsec = record->header.process.nsec;
+	record->header.process = process;
+	record->path_id = path_id;
 	record->path_len = path_len;
 
 	/* Store advanced information */
 	record->action = action;
 	record->protocol = protocol;
 	record->family = family;
-	if (src_ip == NULL)
-		memset(record->src.raw, 0, 16);
-	else
-		copy_ip(record->src.raw, src_ip, family);
-	if (dst_ip == NULL)
-		memset(record->dst.raw, 0, 16);
-	else
-		copy_ip(record->dst.raw, dst_ip, family);
+	memcpy(record->src.raw, fields.src.raw, sizeof(record->src.raw));
+	memcpy(record->dst.raw, fields.dst.raw, sizeof(record->dst.raw));
 	record->src_port = src_port;
 	record->dst_port = dst_port;
 	memcpy(get_netlog_path(record), path, path_len);
 
-	/* Update the next position */
-	log_next_idx += record_size;
-	log_next_seq++;
-
-	spin_unlock_irqrestore(&log_lock, flags);
-
-	/* Wake-up reading threads */
-	wake_up_interruptible(&log_wait);
+	log_commit(&record->header);
 }
 EXPORT_SYMBOL(store_netlog_record);
 
@@ -266,32 +1042,47 @@ store_execlog_record(const char *path,
 		     const char *argv, size_t argv_size)
 {
 	struct execlog_log *record;
+	struct current_details process;
+	struct log_match match;
 	size_t path_len, record_size;
-	unsigned long flags;
+	unsigned int buf_len = READ_ONCE(log_buf_len);
 
 	path_len = strlen(path) + 1;
-	if (unlikely(path_len > (LOG_BUF_LEN >> 5) ||
+	if (unlikely(path_len > (buf_len >> 5) ||
 		     path_len > INT_MAX)) {
 		dev_warn(dev, "Troncating path (size %zu > %i)\n",
-			 path_len, min((LOG_BUF_LEN >> 5), (unsigned int)INT_MAX));
-		path_len = min((LOG_BUF_LEN >> 5), (unsigned int)INT_MAX);
+			 path_len, min((buf_len >> 5), (unsigned int)INT_MAX));
+		path_len = min((buf_len >> 5), (unsigned int)INT_MAX);
+		this_cpu_inc(log_stats.truncated_paths);
 	}
-	if (unlikely(argv_size > (LOG_BUF_LEN >> 5) ||
+	if (unlikely(argv_size > (buf_len >> 5) ||
 		     argv_size > INT_MAX)) {
 		dev_warn(dev, "Troncating argv (size %zu > %i)\n",
-			 argv_size, min((LOG_BUF_LEN >> 5), (unsigned int)INT_MAX));
-		argv_size = min((LOG_BUF_LEN >> 5), (unsigned int)INT_MAX);
+			 argv_size, min((buf_len >> 5), (unsigned int)INT_MAX));
+		argv_size = min((buf_len >> 5), (unsigned int)INT_MAX);
+		this_cpu_inc(log_stats.truncated_argv);
 	}
-	record_size = sizeof(struct execlog_log) + path_len + argv_size;
+	record_size = ALIGN(sizeof(struct execlog_log) + path_len + argv_size,
+			    LOG_ALIGN);
+
+	/* Gather everything first, to compare it with the previous record */
+	fill_current_details(&process);
+	match.process = &process;
+	match.netlog = NULL;
+	match.path_id = 0;
+	match.path = path;
+	match.path_len = path_len;
+	match.argv = argv;
+	match.argv_len = argv_size;
 
-	spin_lock_irqsave(&log_lock, flags);
+	record = (struct execlog_log *)log_reserve(LOG_EXECUTION, record_size,
+						   log_match_init(&match));
+	if (unlikely(record == NULL))
+		return;
 
-	find_new_record_place(record_size);
-	record = (struct execlog_log *)(log_buf + log_next_idx);
-	/* Store basic information */
-	fill_current_details(&(record->header.process));
-	record->header.type = LOG_EXECUTION;
-	record->header.len = record_size;
+	/* Store basic information, with the timestamp from log_reserve */
+	process.nsec = record->header.process.nsec;
+	record->header.process = process;
 
 	/* Store advanced information */
 	record->path_len = path_len;
@@ -299,389 +1090,3351 @@ store_execlog_record(const char *path,
 	record->argv_len = argv_size;
 	memcpy(get_execlog_argv(record), argv, argv_size);
 
-	/* Update the next position */
-	log_next_idx += record_size;
-	log_next_seq++;
-
-	spin_unlock_irqrestore(&log_lock, flags);
-
-	/* Wake-up reading threads */
-	wake_up_interruptible(&log_wait);
+	log_commit(&record->header);
 }
 EXPORT_SYMBOL(store_execlog_record);
 
 
-struct user_data {
-	u64 log_curr_seq;
-	u32 log_curr_idx;
-	u8  simple_format;
-	u8  send_eof;
-	struct mutex lock /** Lock when reading (only one read a at time) */;
-	char buf[USER_BUFFER_SIZE];
+/* Position of a reader inside one buffer */
+struct log_cursor {
+	u64 seq /** Sequence number of the next record to read */;
+	u32 idx /** Index of the next record to read */;
+	u8  peeked /** The two fields below describe the next record */;
+	u64 nsec /** Timestamp of the next record */;
+	u64 gseq /** Global sequence number of the next record */;
+	u32 generation /** Generation of the buffer 'idx' refers to */;
+	u64 count[LOG_NR_TYPES] /** Number of records of each type before 'seq' */;
+	u64 last_nsec /** Timestamp of the last record read, 0 if unknown */;
+	struct log_cold_cache *cold /** Last compressed block read, NULL if the reader doesn't read them */;
 };
 
+/* Consistent copy of the indexes and sequence numbers of a buffer */
+struct log_ring_pos {
+	u64 first_seq;
+	u64 next_seq;
+	u32 first_idx;
+	u32 next_idx;
+	char *buf /** Only valid under rcu_read_lock */;
+	u32 size;
+	u32 generation;
+	struct log_index_entry *index /** Only valid under rcu_read_lock */;
+	u32 index_len;
+	u64 stored[LOG_NR_TYPES];
+	u64 dropped[LOG_NR_TYPES];
+	u64 last_dropped_nsec;
+	u64 repeat_seq;
+	u64 repeat_until;
+	unsigned int count /** Value of pos_seq when this copy was taken */;
+};
 
-static loff_t
-secure_log_llseek(struct file *file, loff_t offset, int whence)
-{
-	struct user_data *data = file->private_data;
-	unsigned long flags;
+/* Records lost by a reader, not reported yet */
+struct log_gap {
+	u64 lost[LOG_NR_TYPES];
+	u64 after_nsec;
+	u64 until_nsec;
+};
 
-	if (unlikely(data == NULL))
-		return -EBADF;
+/* Snapshots of records: the text output can't be bigger than
+ * USER_BUFFER_SIZE, longer strings are cut when copied */
+#define RECORD_SNAPSHOT_SIZE (sizeof(struct netlog_log) + USER_BUFFER_SIZE)
 
-	/* Support rsyslog file reader: accept but ignore custom seeks */
-	if (unlikely(offset != 0))
-		return 0;
+/* Longest octet-counting frame header: "%zu " of a formatted record, which
+ * is at most USER_BUFFER_SIZE long */
+#define OCTET_COUNT_MAX 8
 
-	/* Set the 'offset' to the desired value */
-	spin_lock_irqsave(&log_lock, flags);
-	switch (whence) {
-	case SEEK_SET:
-		data->log_curr_seq = log_first_seq;
-		data->log_curr_idx = log_first_idx;
-		break;
-	case SEEK_CUR:
+/*
+ * Shorten the strings of a partially copied record so that they fit
+ * inside the 'copied' bytes of the snapshot
+ */
+static void
+log_record_clip(struct sec_log *record, size_t copied)
+{
+	struct netlog_log *netlog;
+	struct execlog_log *execlog;
+	size_t avail;
+
+	record->len = copied;
+	switch (record->type) {
+	case LOG_NETWORK_INTERACTION:
+		if (copied < sizeof(struct netlog_log))
+			break;
+		netlog = (struct netlog_log *)record;
+		avail = copied - sizeof(struct netlog_log);
+		netlog->path_len = min(netlog->path_len, avail);
 		break;
-	case SEEK_END:
-		data->log_curr_seq = log_next_seq;
-		data->log_curr_idx = log_next_idx;
+	case LOG_EXECUTION:
+		if (copied < sizeof(struct execlog_log))
+			break;
+		execlog = (struct execlog_log *)record;
+		avail = copied - sizeof(struct execlog_log);
+		execlog->path_len = min(execlog->path_len, avail);
+		avail -= execlog->path_len;
+		execlog->argv_len = min(execlog->argv_len, avail);
 		break;
 	default:
-		spin_unlock_irqrestore(&log_lock, flags);
-		return -EINVAL;
+		break;
 	}
-	spin_unlock_irqrestore(&log_lock, flags);
-
-	return 0;
 }
 
+/*
+ * Copy (at most 'size' bytes of) the record starting at '*idx' into 'dst',
+ * following the wrap around if needed. On success, '*idx' and '*len' are
+ * set to the real index and length of the record.
+ * Returns -EAGAIN if the record is not committed yet.
+ * The record may be overwritten while we copy it: this function never
+ * trusts what it reads and returns -EINVAL on incoherent data.
+ */
+static int
+log_record_copy(const struct log_ring_pos *pos, u32 *idx, size_t *len,
+		struct sec_log *dst, size_t size)
+{
+	struct sec_log *record;
+	size_t record_len;
 
-#define UPDATE_POINTERS(change, remaining, len) \
-do {						\
-	if (change >= remaining) {		\
-		/* Output truncated */		\
-		return 0;			\
-	}					\
-	/* 'change' is always > 0 */		\
-	len += (unsigned long) change;		\
-	remaining -= (unsigned long) change;	\
-} while (0)
+	if (unlikely(*idx > pos->size - sizeof(struct sec_log)))
+		return -EINVAL;
+	record = (struct sec_log *)(pos->buf + *idx);
+	if (READ_ONCE(record->len) == 0) {
+		/* We have cycled back to the start */
+		*idx = 0;
+		record = (struct sec_log *)pos->buf;
+	}
 
+	/* The record is reserved but still being written */
+	if (!READ_ONCE(record->committed))
+		return -EAGAIN;
+	/* Don't read the content before the commit flag */
+	smp_rmb();
 
-static size_t
-netlog_print(struct netlog_log *record, char *data, size_t len)
+	record_len = READ_ONCE(record->len);
+	if (unlikely(record_len < sizeof(struct sec_log) ||
+		     record_len > pos->size - *idx))
+		return -EINVAL;
+
+	memcpy(dst, record, min(record_len, size));
+	log_record_clip(dst, min(record_len, size));
+	*len = record_len;
+	return 0;
+}
+
+/* Get the current positions in a buffer. Readers never take log_lock:
+ * they retry if a producer moved the positions meanwhile */
+static void
+log_ring_get_pos(struct log_ring *ring, struct log_ring_pos *pos)
+{
+	unsigned int start;
+
+	do {
+		start = read_seqcount_begin(&ring->pos_seq);
+		pos->first_seq = ring->first_seq;
+		pos->first_idx = ring->first_idx;
+		pos->next_seq = ring->next_seq;
+		pos->next_idx = ring->next_idx;
+		pos->buf = ring->buf;
+		pos->size = ring->size;
+		pos->generation = ring->generation;
+		pos->index = ring->index;
+		pos->index_len = ring->index_len;
+		memcpy(pos->stored, ring->stored, sizeof(pos->stored));
+		memcpy(pos->dropped, ring->dropped, sizeof(pos->dropped));
+		pos->last_dropped_nsec = ring->last_dropped_nsec;
+		pos->repeat_seq = ring->repeat_seq;
+		pos->repeat_until = ring->repeat_until;
+	} while (read_seqcount_retry(&ring->pos_seq, start));
+	pos->count = start;
+}
+
+/* Is the record 'seq' held back by log_coalesce ? */
+static inline bool
+log_ring_held(const struct log_ring_pos *pos, u64 seq)
+{
+	return unlikely(seq == pos->repeat_seq) &&
+	       local_clock() < pos->repeat_until;
+}
+
+/* Copy the index entry of the record 'seq', returns false if it's not there */
+static bool
+log_index_get(const struct log_ring_pos *pos, u64 seq,
+	      struct log_index_entry *dst)
+{
+	const struct log_index_entry *entry;
+
+	entry = &pos->index[(seq >> LOG_INDEX_SHIFT) & (pos->index_len - 1)];
+	if (READ_ONCE(entry->seq) != seq)
+		return false;
+	smp_rmb();
+	dst->gseq = entry->gseq;
+	dst->nsec = entry->nsec;
+	dst->idx = entry->idx;
+	memcpy(dst->count, entry->count, sizeof(dst->count));
+	smp_rmb();
+	return READ_ONCE(entry->seq) == seq;
+}
+
+/*
+ * The buffer was replaced since the cursor was set (see log_resize): find
+ * the index of its record in the new one, from the last indexed record
+ * before it.
+ * Returns -EINVAL on incoherent data.
+ */
+static int
+log_cursor_relocate(const struct log_ring_pos *pos, struct log_cursor *cursor)
+{
+	struct log_index_entry entry;
+	struct sec_log *record;
+	size_t len;
+	u64 seq = cursor->seq & ~(u64)(LOG_INDEX_STEP - 1);
+	u32 idx;
+
+	if (seq >= pos->first_seq && log_index_get(pos, seq, &entry)) {
+		idx = entry.idx;
+	} else {
+		seq = pos->first_seq;
+		idx = pos->first_idx;
+	}
+
+	for (; seq < cursor->seq; ++seq) {
+		if (unlikely(idx > pos->size - sizeof(struct sec_log)))
+			return -EINVAL;
+		record = (struct sec_log *)(pos->buf + idx);
+		if (READ_ONCE(record->len) == 0) {
+			idx = 0;
+			record = (struct sec_log *)pos->buf;
+		}
+		len = READ_ONCE(record->len);
+		if (unlikely(len < sizeof(struct sec_log) ||
+			     len > pos->size - idx))
+			return -EINVAL;
+		/* Checked just above */
+		idx += (u32)len;
+	}
+	cursor->idx = idx;
+	cursor->generation = pos->generation;
+	return 0;
+}
+
+/* Account for the records lost by a cursor, which is before 'pos' */
+static void
+log_gap_add(struct log_gap *gap, const struct log_cursor *cursor,
+	    const struct log_ring_pos *pos)
+{
+	unsigned int type;
+
+	for (type = 0; type < LOG_NR_TYPES; ++type)
+		if (pos->dropped[type] > cursor->count[type])
+			gap->lost[type] += pos->dropped[type] - cursor->count[type];
+	if (cursor->last_nsec != 0 &&
+	    (gap->after_nsec == 0 || cursor->last_nsec < gap->after_nsec))
+		gap->after_nsec = cursor->last_nsec;
+	gap->until_nsec = max(gap->until_nsec, pos->last_dropped_nsec);
+}
+
+/*
+ * Cold region: with cold_size set, a worker keeps LZ4-compressed copies of
+ * the records of each buffer, in blocks of up to LOG_COLD_BLOCK bytes of
+ * records. The oldest blocks are freed once the memory used by those of a
+ * buffer exceeds its share of cold_size. Readers which lost records from
+ * a buffer read them from these blocks, transparently.
+ */
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+#define LOG_COLD_LZ4 1
+#endif /* CONFIG_LZ4_COMPRESS && CONFIG_LZ4_DECOMPRESS */
+
+#define LOG_COLD_BLOCK (32 * 1024)
+#define LOG_COLD_COMP_SIZE (LOG_COLD_BLOCK + LOG_COLD_BLOCK / 255 + 16)
+#define LOG_COLD_INTERVAL (HZ / 10)
+#define LOG_COLD_NONE (~0ULL)
+
+struct log_cold_block {
+	struct list_head list /** Entry in log_cold.blocks */;
+	struct rcu_head rcu;
+	u64 first_seq /** Sequence number (in the buffer) of the first record */;
+	u64 next_seq  /** Sequence number of the record following the last one */;
+	u64 first_nsec /** Timestamp of the first record */;
+	u64 count[LOG_NR_TYPES] /** Number of records of each type before the first one */;
+	u32 raw_len  /** Size of the records */;
+	u32 comp_len /** Size of 'data' */;
+	char data[]  /** Compressed records */;
+};
+
+/* Compressed copies of the records of a buffer */
+struct log_cold {
+	struct list_head blocks /** Oldest first, readers walk it under RCU */;
+	size_t used /** Memory used by the blocks */;
+	u64 copied_seq /** Next record to copy, for log_cold_kick */;
+	int kicked /** log_cold_work was started early, see log_cold_kick */;
+	u64 missed /** Records overwritten before being copied */;
+	/* Only used by log_cold_work */
+	struct log_cursor cursor /** Next record to copy */;
+	struct log_gap gap /** Records overwritten before being copied, counted in 'missed' */;
+	char *raw /** Records waiting to be compressed, LOG_COLD_BLOCK bytes */;
+	u32 raw_len;
+	u64 raw_first_seq;
+	u64 raw_next_seq;
+	u64 raw_first_nsec;
+	u64 raw_count[LOG_NR_TYPES];
+};
+
+/* Position of a reader in the block it reads */
+struct log_cold_cache {
+	u64 first_seq /** Block read, LOG_COLD_NONE if none */;
+	u64 seq /** Sequence number of the record at 'offset' */;
+	u32 offset;
+	u32 raw_len;
+};
+
+/* Last block decompressed on each CPU: readers decompress and read it
+ * with preemption disabled, so they can share it instead of each keeping
+ * one block per buffer */
+struct log_cold_scratch {
+	const struct log_cold *cold /** Copies the block comes from, NULL if none */;
+	u64 first_seq;
+	char *raw /** LOG_COLD_BLOCK bytes */;
+};
+
+static DEFINE_PER_CPU(struct log_cold_scratch, log_cold_scratch);
+
+/* Buffers used by log_cold_work */
+static char *log_cold_comp;
+static void *log_cold_wrkmem;
+static char *log_cold_record;
+
+/* Returns the compressed size, 0 on failure */
+static u32
+log_cold_compress(const char *src, u32 len, char *dst)
+{
+#if !defined(LOG_COLD_LZ4)
+	return 0;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+	int ret;
+
+	ret = LZ4_compress_default(src, dst, (int)len, LOG_COLD_COMP_SIZE,
+				   log_cold_wrkmem);
+	return ret > 0 ? (u32)ret : 0;
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0) */
+	size_t out = LOG_COLD_COMP_SIZE;
+
+	if (lz4_compress((const unsigned char *)src, len, (unsigned char *)dst,
+			 &out, log_cold_wrkmem))
+		return 0;
+	return (u32)out;
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(4, 11, 0) */
+}
+
+/* Returns false unless exactly block->raw_len bytes were decompressed */
+static bool
+log_cold_decompress(const struct log_cold_block *block, char *dst)
+{
+#if !defined(LOG_COLD_LZ4)
+	return false;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+	return LZ4_decompress_safe(block->data, dst, (int)block->comp_len,
+				   LOG_COLD_BLOCK) == (int)block->raw_len;
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 11, 0) */
+	size_t out = LOG_COLD_BLOCK;
+
+	return lz4_decompress_unknownoutputsize(
+			(const unsigned char *)block->data, block->comp_len,
+			(unsigned char *)dst, &out) == 0 &&
+	       out == block->raw_len;
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(4, 11, 0) */
+}
+
+/*
+ * Read the record under a cursor which is not in the buffer anymore from
+ * its compressed copy. Must be called under rcu_read_lock.
+ * Returns -ENOENT if there is no copy, otherwise the same as
+ * log_ring_read: -EPIPE if records were lost before the oldest copy, the
+ * cursor then being moved to it.
+ */
+static int
+log_cold_read(struct log_cold *cold, struct log_cursor *cursor,
+	      struct log_gap *gap, const struct log_ring_pos *pos,
+	      struct sec_log *dst, size_t size, bool consume)
+{
+	struct log_cold_cache *cache = cursor->cold;
+	struct log_cold_scratch *scratch;
+	struct log_cold_block *block;
+	struct sec_log *record;
+	unsigned int type;
+	u32 len;
+
+	list_for_each_entry_rcu(block, &cold->blocks, list) {
+		if (cursor->seq >= block->next_seq)
+			continue;
+		if (cursor->seq < block->first_seq) {
+			/* Lost before this block, restart there */
+			for (type = 0; type < LOG_NR_TYPES; ++type)
+				if (block->count[type] > cursor->count[type])
+					gap->lost[type] += block->count[type] -
+							   cursor->count[type];
+			if (cursor->last_nsec != 0 &&
+			    (gap->after_nsec == 0 ||
+			     cursor->last_nsec < gap->after_nsec))
+				gap->after_nsec = cursor->last_nsec;
+			gap->until_nsec = max(gap->until_nsec,
+					      block->first_nsec);
+			cursor->seq = block->first_seq;
+			memcpy(cursor->count, block->count,
+			       sizeof(cursor->count));
+			cursor->peeked = 0;
+			return -EPIPE;
+		}
+		goto found;
+	}
+	return -ENOENT;
+
+found:
+	scratch = get_cpu_ptr(&log_cold_scratch);
+	if (scratch->cold != cold || scratch->first_seq != block->first_seq) {
+		scratch->cold = NULL;
+		if (WARN_ON(!log_cold_decompress(block, scratch->raw))) {
+			put_cpu_ptr(&log_cold_scratch);
+			return -ENOENT;
+		}
+		scratch->cold = cold;
+		scratch->first_seq = block->first_seq;
+	}
+	if (cache->first_seq != block->first_seq) {
+		cache->first_seq = block->first_seq;
+		cache->raw_len = block->raw_len;
+		cache->seq = block->first_seq;
+		cache->offset = 0;
+	}
+	if (cache->seq > cursor->seq) {
+		cache->seq = block->first_seq;
+		cache->offset = 0;
+	}
+	/* The records were written by log_cold_work, they are coherent */
+	for (;;) {
+		record = (struct sec_log *)(scratch->raw + cache->offset);
+		if (cache->seq == cursor->seq)
+			break;
+		cache->offset += (u32)record->len;
+		cache->seq++;
+	}
+
+	len = (u32)record->len;
+	memcpy(dst, record, min_t(size_t, len, size));
+	put_cpu_ptr(&log_cold_scratch);
+	log_record_clip(dst, min_t(size_t, len, size));
+	if (consume) {
+		++cursor->seq;
+		if (likely(dst->type < LOG_NR_TYPES))
+			cursor->count[dst->type]++;
+		cursor->last_nsec = dst->process.nsec;
+		/* Find the record in the buffer again once we get there */
+		cursor->generation = pos->generation - 1;
+	}
+	return 0;
+}
+
+/*
+ * Copy the record under the cursor into 'dst' (at most 'size' bytes) and
+ * move the cursor to the next one if 'consume' is set.
+ * Returns 0 on success, -EAGAIN if there is nothing to read and -EPIPE if
+ * records were lost, in which case they are accounted in 'gap' and the
+ * cursor is reset to the first available record.
+ * The copy is done without blocking the producers, which may overwrite
+ * the record meanwhile: this is checked afterwards with the sequence
+ * numbers.
+ */
+static int
+log_ring_read(struct log_ring *ring, struct log_cursor *cursor,
+	      struct log_gap *gap, struct sec_log *dst, size_t size,
+	      bool consume)
+{
+	struct log_ring_pos pos;
+	size_t len;
+	u32 idx, generation;
+	unsigned int count;
+	bool repeat;
+	int ret;
+
+	rcu_read_lock();
+retry:
+	log_ring_get_pos(ring, &pos);
+	/* Perhaps we waited for too long and some data is lost */
+	if (unlikely(cursor->seq < pos.first_seq))
+		goto cold;
+	if (cursor->seq >= pos.next_seq || log_ring_held(&pos, cursor->seq)) {
+		ret = -EAGAIN;
+		goto out;
+	}
+	/* Producers may still count repetitions into it, see below */
+	repeat = unlikely(cursor->seq == pos.repeat_seq);
+	count = pos.count;
+	/* The buffer was resized, our position is meaningless */
+	if (unlikely(cursor->generation != pos.generation) &&
+	    log_cursor_relocate(&pos, cursor))
+		goto lost;
+
+	idx = cursor->idx;
+	ret = log_record_copy(&pos, &idx, &len, dst, size);
+	if (ret == -EAGAIN)
+		goto out;
+
+	/* Make sure that the record was not overwritten while we were
+	 * copying it: the copy must be done before reading the positions
+	 * again, read_seqcount_begin only orders what follows it */
+	smp_rmb();
+	generation = pos.generation;
+	log_ring_get_pos(ring, &pos);
+	if (unlikely(cursor->seq < pos.first_seq))
+		goto cold;
+	/* Moved to another buffer meanwhile, it's still there */
+	if (unlikely(pos.generation != generation))
+		goto retry;
+	if (unlikely(repeat && pos.count != count))
+		goto retry;
+	if (WARN_ON(ret))
+		goto lost;
+
+	if (consume) {
+		/* Length of items inside the cache can't get out of the cache */
+		cursor->idx = (u32)(idx + len);
+		++cursor->seq;
+		if (likely(dst->type < LOG_NR_TYPES))
+			cursor->count[dst->type]++;
+		cursor->last_nsec = dst->process.nsec;
+	}
+	goto out;
+
+cold:
+	/* There may still be a compressed copy of the record */
+	if (ring->cold != NULL && cursor->cold != NULL) {
+		ret = log_cold_read(ring->cold, cursor, gap, &pos, dst, size,
+				    consume);
+		if (ret != -ENOENT)
+			goto out;
+	}
+lost:
+	/* Reset the position and alert the user */
+	log_gap_add(gap, cursor, &pos);
+	cursor->seq = pos.first_seq;
+	cursor->idx = pos.first_idx;
+	cursor->generation = pos.generation;
+	memcpy(cursor->count, pos.dropped, sizeof(cursor->count));
+	cursor->peeked = 0;
+	ret = -EPIPE;
+out:
+	rcu_read_unlock();
+	return ret;
+}
+
+/* Compress the records waiting in cold->raw into a new block */
+static void
+log_cold_flush(struct log_cold *cold, size_t budget)
+{
+	struct log_cold_block *block;
+	u32 comp_len;
+
+	if (cold->raw_len == 0)
+		return;
+
+	comp_len = log_cold_compress(cold->raw, cold->raw_len, log_cold_comp);
+	block = comp_len ? kmalloc(sizeof(*block) + comp_len, GFP_KERNEL) : NULL;
+	if (likely(block != NULL)) {
+		block->first_seq = cold->raw_first_seq;
+		block->next_seq = cold->raw_next_seq;
+		block->first_nsec = cold->raw_first_nsec;
+		memcpy(block->count, cold->raw_count, sizeof(block->count));
+		block->raw_len = cold->raw_len;
+		block->comp_len = comp_len;
+		memcpy(block->data, log_cold_comp, comp_len);
+		list_add_tail_rcu(&block->list, &cold->blocks);
+		cold->used += sizeof(*block) + comp_len;
+	}
+	cold->raw_len = 0;
+
+	/* Free the oldest blocks, readers may still be using them */
+	while (cold->used > budget && !list_empty(&cold->blocks)) {
+		block = list_first_entry(&cold->blocks, struct log_cold_block,
+					 list);
+		list_del_rcu(&block->list);
+		cold->used -= sizeof(*block) + block->comp_len;
+		kfree_rcu(block, rcu);
+	}
+}
+
+/* Copy the new records of every buffer into their cold region */
+static void log_cold_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(log_cold_dwork, log_cold_work);
+
+static void
+log_cold_work(struct work_struct *work)
+{
+	struct sec_log *record = (struct sec_log *)log_cold_record;
+	struct log_cold *cold;
+	size_t budget = cold_size / log_nr_rings;
+	unsigned int i, type;
+	int ret;
+
+	for (i = 0; i < log_nr_rings; ++i) {
+		cold = log_rings[i]->cold;
+		WRITE_ONCE(cold->kicked, 0);
+		for (;;) {
+			ret = log_ring_read(log_rings[i], &cold->cursor,
+					    &cold->gap, record,
+					    RECORD_SNAPSHOT_SIZE, true);
+			if (ret == -EAGAIN)
+				break;
+			/* Blocks only contain consecutive records: readers
+			 * get a gap record for the missing ones, see
+			 * log_cold_read */
+			if (ret == -EPIPE) {
+				log_cold_flush(cold, budget);
+				for (type = 0; type < LOG_NR_TYPES; ++type)
+					WRITE_ONCE(cold->missed, cold->missed +
+						   cold->gap.lost[type]);
+				memset(&cold->gap, 0, sizeof(cold->gap));
+				continue;
+			}
+			if (cold->raw_len + record->len > LOG_COLD_BLOCK)
+				log_cold_flush(cold, budget);
+			if (cold->raw_len == 0) {
+				cold->raw_first_seq = cold->cursor.seq - 1;
+				cold->raw_first_nsec = record->process.nsec;
+				memcpy(cold->raw_count, cold->cursor.count,
+				       sizeof(cold->raw_count));
+				if (likely(record->type < LOG_NR_TYPES))
+					cold->raw_count[record->type]--;
+			}
+			/* Snapshots are smaller than LOG_COLD_BLOCK */
+			memcpy(cold->raw + cold->raw_len, record, record->len);
+			cold->raw_len += (u32)record->len;
+			cold->raw_next_seq = cold->cursor.seq;
+			WRITE_ONCE(cold->copied_seq, cold->cursor.seq);
+			if (cold->raw_len == LOG_COLD_BLOCK)
+				log_cold_flush(cold, budget);
+			cond_resched();
+		}
+	}
+	schedule_delayed_work(&log_cold_dwork, LOG_COLD_INTERVAL);
+}
+
+/*
+ * Called by the producers before they overwrite the records before
+ * 'first_seq': start log_cold_work right away once it is behind by half
+ * the buffer, rather than after LOG_COLD_INTERVAL. What it misses anyway
+ * is counted in log_cold.missed.
+ */
+static void
+log_cold_kick(struct log_ring *ring, u64 first_seq)
 __must_hold(log_lock)
 {
-	size_t remaining = USER_BUFFER_SIZE - len;
-	long change;
+	struct log_cold *cold = ring->cold;
+	u64 copied_seq = READ_ONCE(cold->copied_seq);
 
-	if (WARN_ON(record->header.len < sizeof(struct netlog_log))) {
-		change = snprintf(data + len, remaining, "BROKEN RECCORD");
-		UPDATE_POINTERS(change, remaining, len);
-		return len;
+	if (copied_seq >= first_seq &&
+	    copied_seq - first_seq >= (ring->next_seq - first_seq) / 2)
+		return;
+	if (!READ_ONCE(cold->kicked) && !xchg(&cold->kicked, 1))
+		mod_delayed_work(system_wq, &log_cold_dwork, 0);
+}
+
+/* Keys a reader can seek to */
+enum log_seek_key {
+	LOG_SEEK_SEQ  /** Global sequence number of the record */,
+	LOG_SEEK_NSEC /** Timestamp of the record */,
+};
+
+/*
+ * Move the cursor to the first record whose key is at least 'value'.
+ * The sparse index gives the last indexed record before it in O(log n),
+ * then only the records following it are walked through.
+ */
+static void
+log_ring_seek(struct log_ring *ring, struct log_cursor *cursor,
+	      enum log_seek_key key, u64 value)
+{
+	struct log_ring_pos pos;
+	struct log_index_entry entry;
+	struct sec_log *record;
+	u64 lo, hi, mid, seq, record_key;
+	u64 count[LOG_NR_TYPES];
+	u32 idx, generation;
+	size_t len;
+	bool broken;
+	enum secure_log_type type;
+
+	rcu_read_lock();
+retry:
+	log_ring_get_pos(ring, &pos);
+	seq = pos.first_seq;
+	idx = pos.first_idx;
+	memcpy(count, pos.dropped, sizeof(count));
+	broken = false;
+
+	if (pos.next_seq > pos.first_seq) {
+		/* Index entries of the records still in the buffer: [lo, hi[ */
+		lo = (pos.first_seq + LOG_INDEX_STEP - 1) >> LOG_INDEX_SHIFT;
+		hi = ((pos.next_seq - 1) >> LOG_INDEX_SHIFT) + 1;
+		if (hi > lo + pos.index_len)
+			lo = hi - pos.index_len;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (!log_index_get(&pos, mid << LOG_INDEX_SHIFT, &entry))
+				break;
+			if ((key == LOG_SEEK_SEQ ? entry.gseq : entry.nsec) < value) {
+				seq = mid << LOG_INDEX_SHIFT;
+				idx = entry.idx;
+				memcpy(count, entry.count, sizeof(count));
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
 	}
 
-	change = snprintf(data + len, remaining, "%.*s ",
-			  (int)record->path_len, get_netlog_path(record));
-	UPDATE_POINTERS(change, remaining, len);
+	for (; seq < pos.next_seq; ++seq) {
+		if (unlikely(idx > pos.size - sizeof(struct sec_log))) {
+			broken = true;
+			break;
+		}
+		record = (struct sec_log *)(pos.buf + idx);
+		if (READ_ONCE(record->len) == 0) {
+			idx = 0;
+			record = (struct sec_log *)pos.buf;
+		}
+		/* The key of a record being written is unknown, stop there */
+		if (!READ_ONCE(record->committed))
+			break;
+		smp_rmb();
+		if (key == LOG_SEEK_SEQ)
+			record_key = READ_ONCE(record->seq);
+		else
+			record_key = READ_ONCE(record->process.nsec);
+		if (record_key >= value)
+			break;
+		len = READ_ONCE(record->len);
+		if (unlikely(len < sizeof(struct sec_log) ||
+			     len > pos.size - idx)) {
+			broken = true;
+			break;
+		}
+		/* Checked just above */
+		idx += (u32)len;
+		type = READ_ONCE(record->type);
+		if (likely(type < LOG_NR_TYPES))
+			count[type]++;
+	}
 
-	change = print_netlog(data + len, remaining,
-			      record->protocol, record->family, record->action,
-			      &record->src, record->src_port,
-			      &record->dst, record->dst_port);
-	if (change < 0)
+	/* Was anything overwritten while we were walking ? */
+	smp_rmb();
+	generation = pos.generation;
+	log_ring_get_pos(ring, &pos);
+	if (unlikely(pos.generation != generation || seq < pos.first_seq))
+		goto retry;
+
+	if (WARN_ON(broken)) {
+		seq = pos.first_seq;
+		idx = pos.first_idx;
+		memcpy(count, pos.dropped, sizeof(count));
+	}
+	cursor->seq = seq;
+	cursor->idx = idx;
+	cursor->generation = generation;
+	memcpy(cursor->count, count, sizeof(cursor->count));
+	cursor->last_nsec = 0;
+	cursor->peeked = 0;
+	rcu_read_unlock();
+}
+
+/* Position of a reader in the buffers, shared by the members of a group */
+struct log_reader {
+	struct mutex mutex /** Held while the cursors and the gap move */;
+	spinlock_t lock /** Taken to store a cursor, and to look at them without 'mutex' */;
+	/* Buffers read, all of them or those of one type of records */
+	unsigned int first_ring;
+	unsigned int end_ring;
+	struct log_gap gap /** Records lost since the last gap record, protected by 'mutex' */;
+	struct log_cold_cache *cold /** Decompressed blocks, one per buffer, NULL unless cold_size is set */;
+	struct log_cursor cursors[] /** One position per buffer in log_rings */;
+};
+
+static void
+secure_log_reader_free(struct log_reader *reader)
+{
+	mutex_destroy(&reader->mutex);
+	kfree(reader->cold);
+	kfree(reader);
+}
+
+/* Allocate a position in the buffers [first_ring, end_ring[ */
+static struct log_reader *
+secure_log_reader_alloc(unsigned int first_ring, unsigned int end_ring)
+{
+	struct log_reader *reader;
+	unsigned int i;
+
+	reader = kzalloc(sizeof(*reader) +
+			 log_nr_rings * sizeof(struct log_cursor), GFP_KERNEL);
+	if (unlikely(reader == NULL))
+		return NULL;
+	mutex_init(&reader->mutex);
+	spin_lock_init(&reader->lock);
+	reader->first_ring = first_ring;
+	reader->end_ring = end_ring;
+	if (cold_size == 0)
+		return reader;
+
+	/* Position in the compressed copies of each buffer */
+	reader->cold = kcalloc(log_nr_rings, sizeof(*reader->cold), GFP_KERNEL);
+	if (unlikely(reader->cold == NULL)) {
+		kfree(reader);
+		return NULL;
+	}
+	for (i = first_ring; i < end_ring; ++i) {
+		reader->cold[i].first_seq = LOG_COLD_NONE;
+		reader->cursors[i].cold = &reader->cold[i];
+	}
+	return reader;
+}
+
+/* Consumer group: readers sharing one position, each record is returned
+ * to only one of them. See SECURE_LOG_IOC_JOIN_GROUP */
+struct log_group {
+	struct list_head list /** Entry in log_groups */;
+	char name[SECURE_LOG_GROUP_NAME_MAX];
+	unsigned int members /** Number of readers in the group, protected by log_groups_mutex */;
+	struct log_reader *reader /** Position of the group */;
+	wait_queue_head_t wait /** Members wait there exclusively */;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	wait_queue_entry_t forward /** Wakes a member up when log_wait is woken up */;
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0) */
+	wait_queue_t forward /** Wakes a member up when log_wait is woken up */;
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(4, 13, 0) */
+};
+
+static LIST_HEAD(log_groups);
+static DEFINE_MUTEX(log_groups_mutex);
+
+struct user_data {
+	struct list_head list /** Entry in log_readers */;
+	pid_t pid /** Process which opened the device */;
+	u8  simple_format;
+	u8  send_eof;
+	u8  binary_format;
+	u8  octet_counting;
+	struct mutex lock /** Lock when reading (only one read a at time) */;
+	size_t pending /** Length of the formatted record in 'buf' not returned yet */;
+	u32 pending_path /** Interned path defined by the pending output, 0 if none */;
+	u8  fetched /** 'record' holds the next record to format, see secure_log_fetch_record */;
+	u8  filtered /** Only return records matching 'filter' */;
+	struct secure_log_filter filter /** See SECURE_LOG_IOC_SET_FILTER */;
+	struct log_reader __rcu *reader /** Own position, or the one of 'group', see secure_log_reader */;
+	struct log_group *group /** Consumer group joined, if any */;
+	u64 nr_lost /** Records lost since the device was opened */;
+	u64 nr_gaps /** Gap records returned since the device was opened */;
+	/* Wake up policy, see SECURE_LOG_IOC_SET_WAKEUP. Read by the wait
+	 * condition of read(), without data->lock */
+	spinlock_t wakeup_lock /** Taken to change the policy and to start wakeup_timer */;
+	u32 wakeup_events /** Wake up once that many records are available, 0 to disable */;
+	u32 wakeup_bytes  /** Wake up once that many bytes are available, 0 to disable */;
+	unsigned long wakeup_timeout /** Wake up that long (in jiffies) after the first available record, 0 to disable */;
+	struct timer_list wakeup_timer /** Started by the first available record */;
+	u8  wakeup_expired /** Set by wakeup_timer */;
+	DECLARE_BITMAP(paths_sent, LOG_PATHS_MAX + 1) /** Interned paths already defined in the output returned */;
+	u64 latency[LOG_HIST_BUCKETS] /** Time between the storage of the records and their copy to userspace, see SECURE_LOG_IOC_GET_LATENCY */;
+	char buf[USER_BUFFER_SIZE + OCTET_COUNT_MAX];
+	char record[RECORD_SNAPSHOT_SIZE] __aligned(LOG_ALIGN) /** Copy of the record being printed */;
+};
+
+/* Open devices, for the statistics */
+static LIST_HEAD(log_readers);
+static DEFINE_MUTEX(log_readers_mutex);
+
+/* Position of the reader. Joining a group replaces it: data->lock must be
+ * held, or the caller must be in a RCU read-side critical section */
+static inline struct log_reader *
+secure_log_reader(struct user_data *data)
+{
+	return rcu_dereference_check(data->reader,
+				     lockdep_is_held(&data->lock));
+}
+
+/* Report the records lost by the reader with a gap record in data->record.
+ * data->reader->mutex must be held */
+static void
+secure_log_gap_record(struct user_data *data)
+{
+	struct gap_log *record = (struct gap_log *)data->record;
+	struct log_reader *reader = secure_log_reader(data);
+	unsigned int type;
+
+	memset(record, 0, sizeof(*record));
+	record->header.len = sizeof(*record);
+	record->header.type = LOG_GAP;
+	record->header.committed = 1;
+	record->header.process.nsec = reader->gap.until_nsec;
+	for (type = 0; type < LOG_NR_TYPES; ++type) {
+		record->lost[type] = reader->gap.lost[type];
+		data->nr_lost += reader->gap.lost[type];
+	}
+	record->after_nsec = reader->gap.after_nsec;
+	record->until_nsec = reader->gap.until_nsec;
+	data->nr_gaps++;
+
+	memset(&reader->gap, 0, sizeof(reader->gap));
+}
+
+/* State of the next record of a buffer, for a reader */
+enum log_head {
+	LOG_HEAD_NONE    /** Nothing to read */,
+	LOG_HEAD_PENDING /** Still being written, or held back by log_coalesce */,
+	LOG_HEAD_READY   /** Can be read */,
+	LOG_HEAD_LOST    /** Records were lost, the next read reports them */,
+};
+
+/* What is there to read under this cursor ? */
+static enum log_head
+log_ring_head(struct log_ring *ring, struct log_cursor *cursor)
+{
+	struct log_ring_pos pos;
+	struct sec_log *record;
+	enum log_head ret;
+
+	rcu_read_lock();
+	log_ring_get_pos(ring, &pos);
+	if (cursor->seq < pos.first_seq) {
+		ret = LOG_HEAD_LOST;
+	} else if (cursor->seq >= pos.next_seq) {
+		ret = LOG_HEAD_NONE;
+	} else if (log_ring_held(&pos, cursor->seq)) {
+		ret = LOG_HEAD_PENDING;
+	} else if (unlikely(cursor->generation != pos.generation ||
+			    cursor->idx > pos.size - sizeof(struct sec_log))) {
+		/* Let the read sort it out */
+		ret = LOG_HEAD_READY;
+	} else {
+		/* Only committed records can be read */
+		record = (struct sec_log *)(pos.buf + cursor->idx);
+		if (READ_ONCE(record->len) == 0)
+			record = (struct sec_log *)pos.buf;
+		ret = READ_ONCE(record->committed) ? LOG_HEAD_READY :
+						     LOG_HEAD_PENDING;
+	}
+	rcu_read_unlock();
+	return ret;
+}
+
+/* Is there anything left to read from this position ? Consistent with
+ * secure_log_next_record: with several buffers, a pending record in one
+ * of them blocks the others */
+static bool
+log_reader_readable(struct log_reader *reader)
+{
+	unsigned int i;
+	bool ready = false;
+
+	spin_lock(&reader->lock);
+	for (i = reader->first_ring; i < reader->end_ring; ++i) {
+		switch (log_ring_head(log_rings[i], &reader->cursors[i])) {
+		case LOG_HEAD_LOST:
+			ready = true;
+			goto out;
+		case LOG_HEAD_PENDING:
+			if (reader->end_ring - reader->first_ring > 1) {
+				ready = false;
+				goto out;
+			}
+			break;
+		case LOG_HEAD_READY:
+			ready = true;
+			break;
+		default:
+			break;
+		}
+	}
+out:
+	spin_unlock(&reader->lock);
+	return ready;
+}
+
+/*
+ * Read from the buffer 'i' of the reader, see log_ring_read. The record is
+ * copied (and decompressed) with a copy of the cursor, which is only stored
+ * back under reader->lock: those who just look at the cursors don't wait
+ * for the copy. reader->mutex must be held.
+ */
+static int
+log_reader_read(struct log_reader *reader, unsigned int i,
+		struct sec_log *dst, size_t size, bool consume)
+{
+	struct log_cursor cursor = reader->cursors[i];
+	int ret;
+
+	if (consume)
+		cursor.peeked = 0;
+	ret = log_ring_read(log_rings[i], &cursor, &reader->gap, dst, size,
+			    consume);
+	if (ret == 0 && !consume) {
+		cursor.nsec = dst->process.nsec;
+		cursor.gseq = dst->seq;
+		cursor.peeked = 1;
+	}
+
+	spin_lock(&reader->lock);
+	reader->cursors[i] = cursor;
+	spin_unlock(&reader->lock);
+	return ret;
+}
+
+/*
+ * Copy the next record to print into data->record. With per-CPU buffers,
+ * this is the oldest of the next record of each buffer. Nothing is returned
+ * while the next record of one of them is pending, as it may be older than
+ * the others: the output stays ordered, at the cost of waiting for it (up
+ * to coalesce_ms for a record held back by log_coalesce).
+ * Returns 0 on success and -EAGAIN if there is nothing to read. Records
+ * lost by the reader are reported by a gap record.
+ * data->reader->mutex must be held.
+ */
+static int
+secure_log_next_record(struct user_data *data)
+{
+	struct log_reader *reader = secure_log_reader(data);
+	struct sec_log header;
+	struct log_cursor *cursor;
+	struct log_cursor *best = NULL;
+	unsigned int i, best_ring = 0;
+	int ret, lost = 0, pending = 0;
+
+	if (reader->end_ring - reader->first_ring == 1) {
+		ret = log_reader_read(reader, reader->first_ring,
+				      (struct sec_log *)data->record,
+				      RECORD_SNAPSHOT_SIZE, true);
+		if (unlikely(ret == -EPIPE)) {
+			secure_log_gap_record(data);
+			return 0;
+		}
+		return ret;
+	}
+
+	for (i = reader->first_ring; i < reader->end_ring; ++i) {
+		cursor = &reader->cursors[i];
+		if (!cursor->peeked) {
+			ret = log_reader_read(reader, i, &header,
+					      sizeof(header), false);
+			if (ret == -EPIPE)
+				lost = 1;
+			/* Its next record may come before the others */
+			if (ret == -EAGAIN &&
+			    log_ring_head(log_rings[i], cursor) != LOG_HEAD_NONE)
+				pending = 1;
+			if (ret != 0)
+				continue;
+		}
+		if (best == NULL || cursor->nsec < best->nsec ||
+		    (cursor->nsec == best->nsec && cursor->gseq < best->gseq)) {
+			best = cursor;
+			best_ring = i;
+		}
+	}
+
+	if (unlikely(lost)) {
+		secure_log_gap_record(data);
 		return 0;
-	UPDATE_POINTERS(change, remaining, len);
+	}
+	if (best == NULL || pending)
+		return -EAGAIN;
+
+	ret = log_reader_read(reader, best_ring,
+			      (struct sec_log *)data->record,
+			      RECORD_SNAPSHOT_SIZE, true);
+	if (unlikely(ret == -EPIPE)) {
+		secure_log_gap_record(data);
+		return 0;
+	}
+	return ret;
+}
+
+/* Does the record match the filter of the reader ? */
+static bool
+secure_log_filter_match(const struct secure_log_filter *filter,
+			struct sec_log *record)
+{
+	struct netlog_log *netlog;
+	struct execlog_log *execlog;
+	const char *path;
+	size_t path_len;
+
+	/* Readers are always told about what they lost */
+	if (record->type == LOG_GAP)
+		return true;
+
+	if (filter->types && (record->type >= LOG_NR_TYPES ||
+			      !(filter->types & (1U << record->type))))
+		return false;
+	if ((filter->flags & SECURE_LOG_FILTER_UID) &&
+	    (record->process.uid < filter->uid_min ||
+	     record->process.uid > filter->uid_max))
+		return false;
+	if ((filter->flags & SECURE_LOG_FILTER_GID) &&
+	    (record->process.gid < filter->gid_min ||
+	     record->process.gid > filter->gid_max))
+		return false;
+
+	switch (record->type) {
+	case LOG_NETWORK_INTERACTION:
+		if (record->len < sizeof(struct netlog_log))
+			return false;
+		netlog = (struct netlog_log *)record;
+		if (filter->protocols &&
+		    (netlog->protocol >= 32 ||
+		     !(filter->protocols & (1U << netlog->protocol))))
+			return false;
+		if (filter->actions &&
+		    (netlog->action >= 32 ||
+		     !(filter->actions & (1U << netlog->action))))
+			return false;
+		path = get_netlog_path(netlog);
+		path_len = netlog->path_len;
+		break;
+	case LOG_EXECUTION:
+		if (record->len < sizeof(struct execlog_log))
+			return false;
+		execlog = (struct execlog_log *)record;
+		path = get_execlog_path(execlog);
+		path_len = execlog->path_len;
+		break;
+	default:
+		return filter->path_len == 0;
+	}
+
+	/* The path lengths include the tailing '\0' */
+	if (filter->path_len == 0)
+		return true;
+	return path_len > filter->path_len &&
+	       memcmp(path, filter->path, filter->path_len) == 0;
+}
+
+/* Records skipped by the filter in one go, reader->mutex being held: the
+ * other members of a group wait meanwhile */
+#define LOG_FILTER_BATCH 1024
+
+/*
+ * Fetch the next record matching the filter of the reader into
+ * data->record, unless it's already there. The other ones are skipped
+ * without being formatted.
+ * Returns 0 on success, -EAGAIN if there is nothing to read and -EBUSY
+ * if LOG_FILTER_BATCH records were skipped: the caller should call it
+ * again, after rescheduling if it can.
+ */
+static int
+secure_log_fetch_record(struct user_data *data)
+{
+	struct log_reader *reader = secure_log_reader(data);
+	unsigned int skipped = 0;
+	int ret;
+
+	if (data->fetched)
+		return 0;
+
+	/* The position may be shared with the other members of a group */
+	mutex_lock(&reader->mutex);
+	for (;;) {
+		ret = secure_log_next_record(data);
+		if (ret != 0)
+			break;
+		log_path_expand((struct sec_log *)data->record);
+		if (!data->filtered ||
+		    secure_log_filter_match(&data->filter,
+					    (struct sec_log *)data->record))
+			break;
+		if (++skipped == LOG_FILTER_BATCH) {
+			ret = -EBUSY;
+			break;
+		}
+	}
+	mutex_unlock(&reader->mutex);
+	if (ret)
+		return ret;
+	data->fetched = 1;
+
+	/* Pass the baton to another member, see secure_log_read */
+	if (data->group && log_reader_readable(reader))
+		wake_up_interruptible(&data->group->wait);
+	return 0;
+}
+
+/* Is there anything left to read ? */
+static bool
+secure_log_has_data(struct user_data *data)
+{
+	if (data->pending || data->fetched)
+		return true;
+	return log_reader_readable(secure_log_reader(data));
+}
+
+/* Add the (approximate) number of records and bytes waiting for the cursor */
+static void
+log_ring_backlog(struct log_ring *ring, const struct log_cursor *cursor,
+		 u64 *records, u64 *bytes)
+{
+	struct log_ring_pos pos;
+
+	log_ring_get_pos(ring, &pos);
+	if (cursor->seq < pos.first_seq) {
+		/* Lost records: the whole buffer is waiting */
+		*records += pos.next_seq - pos.first_seq;
+		*bytes += pos.size;
+	} else if (cursor->seq < pos.next_seq) {
+		*records += pos.next_seq - cursor->seq;
+		/* The buffer was resized, only the records count */
+		if (cursor->generation != pos.generation)
+			return;
+		if (pos.next_idx > cursor->idx)
+			*bytes += pos.next_idx - cursor->idx;
+		else
+			*bytes += pos.size - cursor->idx + pos.next_idx;
+	}
+}
+
+/* Lower the totals at which the producers wake the readers up */
+static void
+secure_log_wakeup_arm(atomic64_t *target, s64 value)
+{
+	s64 old, prev;
+
+	old = atomic64_read(target);
+	while (value < old) {
+		prev = atomic64_cmpxchg(target, old, value);
+		if (prev == old)
+			break;
+		old = prev;
+	}
+	/* Pairs with the atomic operations in log_commit: either they see
+	 * our target, or we see their records */
+	smp_mb();
+}
+
+/*
+ * Should the reader be woken up, according to its wake up policy ?
+ * If not, make sure that the producers wake it up once it should.
+ * This is the readiness test of poll(), and the wait condition of read()
+ * through secure_log_wait_ready. 'locked' tells if data->lock is held, in
+ * which case the records which don't match the filter of the reader are
+ * skipped first.
+ */
+static bool
+secure_log_ready(struct user_data *data, bool locked)
+{
+	u64 records, bytes, need_records, need_bytes;
+	s64 committed_records, committed_bytes;
+	u32 want_records, want_bytes;
+	unsigned long timeout;
+	struct log_reader *reader;
+	unsigned int i;
+	bool has_data;
+
+	if (data->pending)
+		return true;
+
+	for (;;) {
+		committed_records = atomic64_read(&log_committed_records);
+		committed_bytes = atomic64_read(&log_committed_bytes);
+
+		/* Let read() go on skipping a long run of filtered out
+		 * records, it can reschedule */
+		if (data->filtered && locked &&
+		    secure_log_fetch_record(data) == -EBUSY)
+			return true;
+
+		records = data->fetched;
+		bytes = 0;
+		reader = secure_log_reader(data);
+		spin_lock(&reader->lock);
+		for (i = reader->first_ring; i < reader->end_ring; ++i)
+			log_ring_backlog(log_rings[i], &reader->cursors[i],
+					 &records, &bytes);
+		spin_unlock(&reader->lock);
+		has_data = secure_log_has_data(data);
+
+		spin_lock(&data->wakeup_lock);
+		want_records = data->wakeup_events;
+		want_bytes = data->wakeup_bytes;
+		timeout = data->wakeup_timeout;
+		if (has_data && timeout && !READ_ONCE(data->wakeup_expired) &&
+		    !timer_pending(&data->wakeup_timer))
+			mod_timer(&data->wakeup_timer, jiffies + timeout);
+		spin_unlock(&data->wakeup_lock);
+
+		if (has_data &&
+		    (READ_ONCE(data->wakeup_expired) ||
+		     (want_records && records >= want_records) ||
+		     (want_bytes && bytes >= want_bytes)))
+			return true;
+
+		if (!has_data && records) {
+			/* Blocked behind a record being written, its commit
+			 * may make everything available */
+			need_records = 1;
+			need_bytes = 1;
+		} else {
+			need_records = want_records ?
+				want_records - records : LOG_WAKEUP_NEVER;
+			need_bytes = want_bytes ?
+				want_bytes - bytes : LOG_WAKEUP_NEVER;
+			/* Wait for the first record to start the timer */
+			if (!has_data && timeout)
+				need_records = 1;
+		}
+		secure_log_wakeup_arm(&log_wakeup_records,
+				      need_records >= LOG_WAKEUP_NEVER ?
+				      LOG_WAKEUP_NEVER :
+				      committed_records + (s64)need_records);
+		secure_log_wakeup_arm(&log_wakeup_bytes,
+				      need_bytes >= LOG_WAKEUP_NEVER ?
+				      LOG_WAKEUP_NEVER :
+				      committed_bytes + (s64)need_bytes);
+
+		/* Only the timer wakes us up (timeout only policy, with
+		 * records already available): new records don't matter */
+		if (need_records >= LOG_WAKEUP_NEVER &&
+		    need_bytes >= LOG_WAKEUP_NEVER)
+			return false;
+
+		/* Nothing was committed meanwhile, the producers will wake
+		 * us up */
+		if (atomic64_read(&log_committed_records) == committed_records)
+			return false;
+	}
+}
+
+/* Wait condition of read(), which doesn't hold data->lock while waiting:
+ * the records which don't match the filter are only skipped once woken up */
+static bool
+secure_log_wait_ready(struct user_data *data)
+{
+	bool ready;
+
+	/* Joining a group may replace data->reader meanwhile: the old one
+	 * is only freed after a grace period */
+	rcu_read_lock();
+	ready = secure_log_ready(data, false);
+	rcu_read_unlock();
+	return ready;
+}
+
+/* The reader has read everything: wait for new records from now on */
+static void
+secure_log_wakeup_reset(struct user_data *data)
+{
+	spin_lock(&data->wakeup_lock);
+	del_timer(&data->wakeup_timer);
+	WRITE_ONCE(data->wakeup_expired, 0);
+	spin_unlock(&data->wakeup_lock);
+}
+
+/* Let a reader check its wake up condition again */
+static void
+secure_log_wake_reader(struct user_data *data)
+{
+	struct log_group *group = READ_ONCE(data->group);
+
+	/* We don't know which member of the group it is */
+	if (group)
+		wake_up_interruptible_all(&group->wait);
+	else
+		wake_up_interruptible(&log_wait);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+static void
+secure_log_wakeup_timer(struct timer_list *timer)
+{
+	struct user_data *data = from_timer(data, timer, wakeup_timer);
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0) */
+static void
+secure_log_wakeup_timer(unsigned long arg)
+{
+	struct user_data *data = (struct user_data *)arg;
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(4, 15, 0) */
+
+	WRITE_ONCE(data->wakeup_expired, 1);
+	secure_log_wake_reader(data);
+}
+
+/* Has this reader lost some records ? */
+static bool
+secure_log_has_lost(struct user_data *data)
+{
+	struct log_reader *reader = secure_log_reader(data);
+	struct log_ring_pos pos;
+	unsigned int i;
+	bool lost = false;
+
+	spin_lock(&reader->lock);
+	for (i = reader->first_ring; i < reader->end_ring; ++i) {
+		log_ring_get_pos(log_rings[i], &pos);
+		if (reader->cursors[i].seq < pos.first_seq) {
+			lost = true;
+			break;
+		}
+	}
+	spin_unlock(&reader->lock);
+	return lost;
+}
+
+/* Move all the cursors of a reader to the start or to the end of the
+ * buffers. reader->mutex and reader->lock must be held, unless the reader
+ * is not shared yet */
+static void
+secure_log_set_cursors(struct log_reader *reader, bool end)
+{
+	struct log_ring_pos pos;
+	unsigned int i;
+
+	for (i = reader->first_ring; i < reader->end_ring; ++i) {
+		log_ring_get_pos(log_rings[i], &pos);
+		if (end) {
+			reader->cursors[i].seq = pos.next_seq;
+			reader->cursors[i].idx = pos.next_idx;
+			memcpy(reader->cursors[i].count, pos.stored,
+			       sizeof(reader->cursors[i].count));
+		} else {
+			reader->cursors[i].seq = pos.first_seq;
+			reader->cursors[i].idx = pos.first_idx;
+			memcpy(reader->cursors[i].count, pos.dropped,
+			       sizeof(reader->cursors[i].count));
+		}
+		reader->cursors[i].generation = pos.generation;
+		reader->cursors[i].last_nsec = 0;
+		reader->cursors[i].peeked = 0;
+	}
+}
+
+
+/* Number of records overwritten in all the buffers */
+static u64
+log_overwritten(void)
+{
+	struct log_ring_pos pos;
+	unsigned int i, type;
+	u64 total = 0;
+
+	for (i = 0; i < log_nr_rings; ++i) {
+		log_ring_get_pos(log_rings[i], &pos);
+		for (type = 0; type < LOG_NR_TYPES; ++type)
+			total += pos.dropped[type];
+	}
+	return total;
+}
+
+/* Move all the cursors of a reader to the first record matching 'value' */
+static int
+secure_log_seek(struct user_data *data, enum log_seek_key key, u64 value)
+{
+	struct log_reader *reader;
+	struct log_cursor cursor;
+	unsigned int i;
+	int err;
+
+	err = mutex_lock_interruptible(&data->lock);
+	if (err)
+		return err;
+	reader = secure_log_reader(data);
+
+	/* Forget what was read but not returned yet. Members of a group
+	 * move the whole group */
+	data->pending = 0;
+	data->fetched = 0;
+	mutex_lock(&reader->mutex);
+	memset(&reader->gap, 0, sizeof(reader->gap));
+	for (i = reader->first_ring; i < reader->end_ring; ++i) {
+		/* Walk the buffer without reader->lock, see log_reader_read */
+		cursor = reader->cursors[i];
+		log_ring_seek(log_rings[i], &cursor, key, value);
+		spin_lock(&reader->lock);
+		reader->cursors[i] = cursor;
+		spin_unlock(&reader->lock);
+	}
+	mutex_unlock(&reader->mutex);
+
+	mutex_unlock(&data->lock);
+	return 0;
+}
+
+static loff_t
+secure_log_llseek(struct file *file, loff_t offset, int whence)
+{
+	struct user_data *data = file->private_data;
+	struct log_reader *reader;
+	int err;
+
+	if (unlikely(data == NULL))
+		return -EBADF;
+
+	/* The offset is the sequence number of the next record to read */
+	if (whence == SEEK_SET && offset > 0) {
+		err = secure_log_seek(data, LOG_SEEK_SEQ, (u64)offset);
+		if (err)
+			return err;
+		return offset;
+	}
+
+	/* Support rsyslog file reader: accept but ignore other custom seeks */
+	if (unlikely(offset != 0))
+		return 0;
+
+	/* Set the 'offset' to the desired value */
+	switch (whence) {
+	case SEEK_SET:
+	case SEEK_END:
+		err = mutex_lock_interruptible(&data->lock);
+		if (err)
+			return err;
+		/* Forget what was read but not returned yet */
+		data->pending = 0;
+		data->fetched = 0;
+		reader = secure_log_reader(data);
+		mutex_lock(&reader->mutex);
+		memset(&reader->gap, 0, sizeof(reader->gap));
+		spin_lock(&reader->lock);
+		secure_log_set_cursors(reader, whence == SEEK_END);
+		spin_unlock(&reader->lock);
+		mutex_unlock(&reader->mutex);
+		mutex_unlock(&data->lock);
+		break;
+	case SEEK_CUR:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+
+#define UPDATE_POINTERS(change, remaining, len) \
+do {						\
+	if (change >= remaining) {		\
+		/* Output truncated */		\
+		return 0;			\
+	}					\
+	/* 'change' is always > 0 */		\
+	len += (unsigned long) change;		\
+	remaining -= (unsigned long) change;	\
+} while (0)
+
+
+static size_t
+netlog_print(struct netlog_log *record, char *data, size_t len)
+{
+	size_t remaining = USER_BUFFER_SIZE - len;
+	long change;
+
+	if (WARN_ON(record->header.len < sizeof(struct netlog_log))) {
+		change = snprintf(data + len, remaining, "BROKEN RECCORD");
+		UPDATE_POINTERS(change, remaining, len);
+		return len;
+	}
+
+	change = snprintf(data + len, remaining, "%.*s ",
+			  (int)record->path_len, get_netlog_path(record));
+	UPDATE_POINTERS(change, remaining, len);
+
+	change = print_netlog(data + len, remaining,
+			      record->protocol, record->family, record->action,
+			      &record->src, record->src_port,
+			      &record->dst, record->dst_port);
+	if (change < 0)
+		return 0;
+	UPDATE_POINTERS(change, remaining, len);
+	return len;
+}
+
+
+static size_t
+execlog_print(struct execlog_log *record, char *data, size_t len)
+{
+	size_t remaining = USER_BUFFER_SIZE - len;
+	long change;
+
+	if (WARN_ON(record->header.len < sizeof(struct execlog_log))) {
+		change = snprintf(data + len, remaining, "BROKEN RECCORD");
+		UPDATE_POINTERS(change, remaining, len);
+		return len;
+	}
+
+	change = snprintf(data + len, remaining, "%.*s %.*s",
+			  (int) record->path_len, get_execlog_path(record),
+			  (int) record->argv_len, get_execlog_argv(record));
+	UPDATE_POINTERS(change, remaining, len);
+	return len;
+}
+
+static inline char *
+get_module_name(enum secure_log_type type)
+{
+	switch (type) {
+	case LOG_NETWORK_INTERACTION:
+		return "netlog";
+	case LOG_EXECUTION:
+		return "execlog";
+	case LOG_GAP:
+	case LOG_PATH:
+		return MODULE_NAME;
+	default:
+		return "unknown";
+	}
+}
+
+static size_t
+gap_print(struct gap_log *record, char *data, size_t len)
+{
+	size_t remaining = USER_BUFFER_SIZE - len;
+	unsigned long after_rem, until_rem;
+	u64 total = 0, after, until;
+	unsigned int type;
+	long change;
+
+	for (type = 0; type < LOG_NR_TYPES; ++type)
+		total += record->lost[type];
+	change = snprintf(data + len, remaining, "lost %llu records (",
+			  (unsigned long long)total);
+	UPDATE_POINTERS(change, remaining, len);
+
+	for (type = 0; type < LOG_NR_TYPES; ++type) {
+		change = snprintf(data + len, remaining, "%s%s: %llu",
+				  type ? ", " : "", get_module_name(type),
+				  (unsigned long long)record->lost[type]);
+		UPDATE_POINTERS(change, remaining, len);
+	}
+
+	after = record->after_nsec;
+	after_rem = do_div(after, 1000000000);
+	until = record->until_nsec;
+	until_rem = do_div(until, 1000000000);
+	change = snprintf(data + len, remaining,
+			  ") after [%5lu.%06lu] until [%5lu.%06lu]",
+			  (unsigned long)after, after_rem / 1000,
+			  (unsigned long)until, until_rem / 1000);
+	UPDATE_POINTERS(change, remaining, len);
+	return len;
+}
+
+static size_t
+repeat_print(struct sec_log *record, char *data, size_t len)
+{
+	size_t remaining = USER_BUFFER_SIZE - len;
+	unsigned long first_rem, last_rem;
+	u64 first, last;
+	long change;
+
+	first = record->process.nsec;
+	first_rem = do_div(first, 1000000000);
+	last = record->repeat_nsec;
+	last_rem = do_div(last, 1000000000);
+	change = snprintf(data + len, remaining,
+			  " (repeated %llu times between [%5lu.%06lu] and [%5lu.%06lu])",
+			  (unsigned long long)record->repeat + 1,
+			  (unsigned long)first, first_rem / 1000,
+			  (unsigned long)last, last_rem / 1000);
+	UPDATE_POINTERS(change, remaining, len);
+	return len;
+}
+
+static inline size_t
+secure_log_read_fill_record(char *buf, size_t len, struct sec_log *record)
+{
+	/* Fill the common header 'len' here is only set to the headers, it
+	 * can't overflow here. Gap records are not related to a process */
+	if (record->type != LOG_GAP)
+		len += SPRINTF(buf + len, CURRENT_DETAILS_FORMAT " ",
+			       CURRENT_DETAILS_ARGS(record->process));
+
+	/* Print the content */
+	switch (record->type) {
+	case LOG_NETWORK_INTERACTION:
+		len = netlog_print((struct netlog_log *)record, buf, len);
+		break;
+	case LOG_EXECUTION:
+		len = execlog_print((struct execlog_log *)record, buf, len);
+		break;
+	case LOG_GAP:
+		len = gap_print((struct gap_log *)record, buf, len);
+		break;
+	default:
+		/* We can't overflow here as only static headers have been
+		 * written up to here */
+		len += SPRINTF(buf + len, "Unknown entry");
+	}
+	/* Identical records coalesced into this one */
+	if (record->repeat != 0 && len != 0)
+		len = repeat_print(record, buf, len);
+	if (len == 0) {
+		sprintf(buf + (USER_BUFFER_SIZE - 7), "TRUNC");
+		len = USER_BUFFER_SIZE - 2;
+	}
+	len += SPRINTF(buf + len, "\n");
+
+	return len;
+}
+
+/*
+ * RFC 6587 octet-counting framing: "MSG-LEN SP SYSLOG-MSG", replacing the
+ * trailing newline. 'buf' must have OCTET_COUNT_MAX spare bytes.
+ */
+static size_t
+secure_log_octet_count(char *buf, size_t len)
+{
+	char header[OCTET_COUNT_MAX];
+	size_t header_len;
+
+	if (len && buf[len - 1] == '\n')
+		--len;
+	header_len = (size_t)snprintf(header, sizeof(header), "%zu ", len);
+	memmove(buf + header_len, buf, len);
+	memcpy(buf, header, header_len);
+	return header_len + len;
+}
+
+/*
+ * Binary format, see secure_log_uapi.h
+ */
+
+/* Maximum size of a varint encoding a 64 bits value */
+#define VARINT_MAX 10
+
+/* Upper bound of everything but the strings of a binary record */
+#define BINARY_FIXED_MAX (VARINT_MAX * 18 + 5 + sizeof(((struct current_details *)0)->tty) + 2 * 16)
+
+static size_t
+binary_put_varint(char *buf, u64 value)
+{
+	size_t len = 0;
+
+	while (value >= 0x80) {
+		buf[len++] = (char)(0x80 | (value & 0x7F));
+		value >>= 7;
+	}
+	buf[len++] = (char)value;
+	return len;
+}
+
+static size_t
+binary_put_string(char *buf, const char *str, size_t len)
+{
+	size_t header;
+
+	header = binary_put_varint(buf, len);
+	memcpy(buf + header, str, len);
+	return header + len;
+}
+
+/* Encode 'record' into 'buf', which is at least USER_BUFFER_SIZE long */
+static size_t
+secure_log_binary_record(char *buf, struct sec_log *record)
+{
+	struct current_details *process = &record->process;
+	struct netlog_log *netlog;
+	struct execlog_log *execlog;
+	struct gap_log *gap;
+	struct path_log *path;
+	size_t len, header, avail, path_len, argv_len, ip_len;
+	unsigned int type;
+	char *body;
+
+	/* Strings are shortened so that everything fits in the buffer */
+	avail = USER_BUFFER_SIZE - BINARY_FIXED_MAX;
+
+	/* Leave space for the length, written at the end */
+	body = buf + VARINT_MAX;
+	len = 0;
+	body[len++] = SECURE_LOG_BINARY_VERSION;
+	body[len++] = (char)record->type;
+	len += binary_put_varint(body + len, process->nsec);
+	len += binary_put_varint(body + len, record->seq);
+	len += binary_put_varint(body + len, (u32)process->pid);
+	len += binary_put_varint(body + len, (u32)process->sid);
+	len += binary_put_varint(body + len, (u32)process->ppid);
+	len += binary_put_varint(body + len, (u32)process->uid);
+	len += binary_put_varint(body + len, (u32)process->gid);
+	len += binary_put_varint(body + len, (u32)process->euid);
+	len += binary_put_varint(body + len, (u32)process->egid);
+	len += binary_put_string(body + len, process->tty,
+				 strnlen(process->tty, sizeof(process->tty)));
+
+	switch (record->type) {
+	case LOG_NETWORK_INTERACTION:
+		if (WARN_ON(record->len < sizeof(struct netlog_log)))
+			break;
+		netlog = (struct netlog_log *)record;
+		body[len++] = (char)netlog->protocol;
+		body[len++] = (char)netlog->action;
+		body[len++] = (char)netlog->family;
+		len += binary_put_varint(body + len, (u32)netlog->src_port);
+		len += binary_put_varint(body + len, (u32)netlog->dst_port);
+		switch (netlog->family) {
+		case AF_INET:
+			ip_len = sizeof(struct in_addr);
+			break;
+		case AF_INET6:
+			ip_len = sizeof(struct in6_addr);
+			break;
+		default:
+			ip_len = 0;
+			break;
+		}
+		memcpy(body + len, netlog->src.raw, ip_len);
+		len += ip_len;
+		memcpy(body + len, netlog->dst.raw, ip_len);
+		len += ip_len;
+		/* Interned paths are defined by a LOG_PATH record */
+		len += binary_put_varint(body + len, netlog->path_id);
+		path_len = netlog->path_id ? 0 :
+			   strnlen(get_netlog_path(netlog),
+				   min(netlog->path_len, avail));
+		len += binary_put_string(body + len, get_netlog_path(netlog),
+					 path_len);
+		break;
+	case LOG_EXECUTION:
+		if (WARN_ON(record->len < sizeof(struct execlog_log)))
+			break;
+		execlog = (struct execlog_log *)record;
+		path_len = strnlen(get_execlog_path(execlog),
+				   min(execlog->path_len, avail));
+		len += binary_put_string(body + len, get_execlog_path(execlog),
+					 path_len);
+		avail -= path_len;
+		argv_len = strnlen(get_execlog_argv(execlog),
+				   min(execlog->argv_len, avail));
+		len += binary_put_string(body + len, get_execlog_argv(execlog),
+					 argv_len);
+		break;
+	case LOG_GAP:
+		gap = (struct gap_log *)record;
+		len += binary_put_varint(body + len, LOG_NR_TYPES);
+		for (type = 0; type < LOG_NR_TYPES; ++type)
+			len += binary_put_varint(body + len, gap->lost[type]);
+		len += binary_put_varint(body + len, gap->after_nsec);
+		len += binary_put_varint(body + len, gap->until_nsec);
+		break;
+	case LOG_PATH:
+		path = (struct path_log *)record;
+		len += binary_put_varint(body + len, path->path->id);
+		len += binary_put_string(body + len, path->path->path,
+					 path->path->len - 1);
+		break;
+	default:
+		break;
+	}
+	len += binary_put_varint(body + len, record->repeat);
+	len += binary_put_varint(body + len, record->repeat_nsec);
+
+	/* Prefix the record by its length */
+	header = binary_put_varint(buf, len);
+	memmove(buf + header, body, len);
+	return header + len;
+}
+
+/*
+ * Define the interned path of a record in the binary output, the first
+ * time the reader meets it. The record itself then fits in what's left of
+ * the buffer, as its path is not repeated. The path is only known to be
+ * defined once the output is returned: it may still be dropped by a seek.
+ */
+static size_t
+secure_log_binary_path(struct user_data *data, struct sec_log *record)
+{
+	struct netlog_log *netlog = (struct netlog_log *)record;
+	struct path_log path;
+
+	if (record->type != LOG_NETWORK_INTERACTION || netlog->path_id == 0 ||
+	    test_bit(netlog->path_id, data->paths_sent))
+		return 0;
+
+	path.path = log_path_get(netlog->path_id);
+	if (WARN_ON(path.path == NULL))
+		return 0;
+	data->pending_path = netlog->path_id;
+	memset(&path.header, 0, sizeof(path.header));
+	path.header.len = sizeof(path);
+	path.header.type = LOG_PATH;
+	path.header.committed = 1;
+	path.header.process.nsec = record->process.nsec;
+	return secure_log_binary_record(data->buf, &path.header);
+}
+
+/* Format the record copied by secure_log_next_record into data->buf */
+static size_t
+secure_log_format_record(struct user_data *data)
+{
+	struct sec_log *record = (struct sec_log *)data->record;
+	u64 ts;
+	unsigned long rem_nsec;
+	size_t len;
+
+	if (data->binary_format) {
+		data->pending_path = 0;
+		len = secure_log_binary_path(data, record);
+		return len + secure_log_binary_record(data->buf + len, record);
+	}
+
+	ts = record->process.nsec;
+	rem_nsec = do_div(ts, 1000000000);
+	if (data->simple_format == 0) {
+		/* Fill the syslog header */
+		len = SPRINTF(data->buf, "<%u>1 - - %s - - - [%5lu.%06lu]: ",
+			      (LOG_FACILITY << 3) | LOG_LEVEL,
+			      get_module_name(record->type),
+			      (unsigned long)ts, rem_nsec / 1000);
+	} else {
+		/* Use a simpler header */
+		len = SPRINTF(data->buf, "%s [%5lu.%06lu]: ",
+			      get_module_name(record->type),
+			      (unsigned long)ts, rem_nsec / 1000);
+	}
+
+	len = secure_log_read_fill_record(data->buf, len, record);
+	if (data->octet_counting)
+		len = secure_log_octet_count(data->buf, len);
 	return len;
 }
 
+/* Destination of a read: an iov_iter, which also covers splice(), or a
+ * plain user buffer on older kernels */
+struct secure_log_dest {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+	struct iov_iter *iter;
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(3, 16, 0) */
+	char __user *buf;
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(3, 16, 0) */
+};
+
+/* Copy 'len' bytes to the reader, returns false on fault */
+static bool
+secure_log_copy_out(struct secure_log_dest *dest, const char *src, size_t len)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+	/* A partial copy is never reported to the reader */
+	return copy_to_iter(src, len, dest->iter) == len;
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(3, 16, 0) */
+	if (copy_to_user(dest->buf, src, len))
+		return false;
+	dest->buf += len;
+	return true;
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(3, 16, 0) */
+}
+
+/* Account for the latency of the record which was just returned */
+static void
+secure_log_latency_add(struct user_data *data)
+{
+	struct sec_log *record = (struct sec_log *)data->record;
+	u64 now = local_clock();
+
+	/* Gap records are not produced by a process, clocks of the CPUs
+	 * may differ */
+	if (record->type < LOG_NR_TYPES)
+		log_hist_add(data->latency, now > record->process.nsec ?
+			     now - record->process.nsec : 0);
+}
+
+/*
+ * Return as many whole records as fit in 'count' bytes. A record which
+ * does not fit is kept formatted in data->buf for the next call.
+ */
+static ssize_t
+secure_log_do_read(struct file *file, struct secure_log_dest *dest,
+		   size_t count)
+{
+	struct user_data *data = file->private_data;
+	struct log_group *group;
+	size_t copied = 0;
+	ssize_t err, ret = 0;
+
+	if (unlikely(data == NULL))
+		return -EBADF;
+
+	/* Is the user already reading ? */
+	err = mutex_lock_interruptible(&data->lock);
+	if (err)
+		return err;
+
+	while (copied < count) {
+		if (data->pending == 0) {
+			ret = secure_log_fetch_record(data);
+			if (ret == -EBUSY) {
+				/* Long run of filtered out records */
+				cond_resched();
+				continue;
+			}
+			if (ret == -EAGAIN) {
+				secure_log_wakeup_reset(data);
+
+				/* The producers only wake the readers up once
+				 * some reader armed a target: do it for the
+				 * poll() or read() coming after this one */
+				if (copied || (file->f_flags & O_NONBLOCK) ||
+				    data->send_eof)
+					secure_log_ready(data, true);
+
+				/* Only wait if we have nothing to return */
+				if (copied)
+					break;
+
+				/* Too bad, this call cannot be non-blocking */
+				if (file->f_flags & O_NONBLOCK)
+					goto out;
+
+				/* The caller asked for a EOF */
+				if (data->send_eof) {
+					ret = 0;
+					goto out;
+				}
+
+				/* Don't block seeks, ioctls and poll() while
+				 * waiting: they may change what we wait for */
+				group = data->group;
+				mutex_unlock(&data->lock);
+
+				/* Only one member of a group is woken up at
+				 * a time, it wakes the next one up once it
+				 * got its record */
+				if (group)
+					err = wait_event_interruptible_exclusive(
+						group->wait,
+						secure_log_wait_ready(data));
+				else
+					err = wait_event_interruptible(log_wait,
+						secure_log_wait_ready(data));
+				if (!err)
+					err = mutex_lock_interruptible(&data->lock);
+				if (err)
+					return err;
+				/* Start over, someone may have read or moved
+				 * the position meanwhile */
+				continue;
+			}
+
+			/* Print our own copy of the record, without blocking
+			 * the producers */
+			data->pending = secure_log_format_record(data);
+			data->fetched = 0;
+		}
+
+		/* Records are never split */
+		if (data->pending > count - copied) {
+			if (copied == 0) {
+				/* The user buffer is too small, abort */
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		}
+
+		/* Copy the data to the reader */
+		if (unlikely(!secure_log_copy_out(dest, data->buf,
+						  data->pending))) {
+			/* Copy failed, keep the record for the next call */
+			if (copied == 0) {
+				ret = -EFAULT;
+				goto out;
+			}
+			break;
+		}
+		copied += data->pending;
+		data->pending = 0;
+		if (data->pending_path)
+			set_bit(data->pending_path, data->paths_sent);
+		secure_log_latency_add(data);
+	}
+	/* copied <= count, which fits in a ssize_t for read() */
+	ret = (ssize_t)copied;
+out:
+	mutex_unlock(&data->lock);
+	return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+/* Also used by splice(), which hands us the pages of the pipe */
+static ssize_t
+secure_log_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct secure_log_dest dest = { .iter = to };
+
+	return secure_log_do_read(iocb->ki_filp, &dest, iov_iter_count(to));
+}
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(3, 16, 0) */
+static ssize_t
+secure_log_read(struct file *file, char __user *buf, size_t count,
+		loff_t *offset)
+{
+	struct secure_log_dest dest = { .buf = buf };
+
+	return secure_log_do_read(file, &dest, count);
+}
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(3, 16, 0) */
+
+static unsigned int
+secure_log_poll(struct file *file, poll_table *wait)
+{
+	struct user_data *data = file->private_data;
+	unsigned int ret = 0;
+	struct log_group *group;
+	bool ready, lost;
+
+	if (unlikely(data == NULL))
+		return POLLERR|POLLNVAL;
+
+	/* Update the poll state */
+	group = READ_ONCE(data->group);
+	poll_wait(file, group ? &group->wait : &log_wait, wait);
+
+	/* Check if there is anything to read, according to the wake up
+	 * policy and the filter of the reader. While another thread reads,
+	 * the filtered out records can't be skipped: report them */
+	if (mutex_trylock(&data->lock)) {
+		/* Skipping the records may sleep, on data->reader->mutex */
+		ready = secure_log_ready(data, true);
+		lost = ready && secure_log_has_lost(data);
+		mutex_unlock(&data->lock);
+	} else {
+		/* Without data->lock, joining a group may replace
+		 * data->reader meanwhile: the old one is only freed after
+		 * a grace period */
+		rcu_read_lock();
+		ready = secure_log_ready(data, false);
+		lost = ready && secure_log_has_lost(data);
+		rcu_read_unlock();
+	}
+
+	/* Data has vanished underneath us: the next read returns a gap
+	 * record */
+	if (ready)
+		ret = lost ? POLLIN|POLLRDNORM|POLLPRI : POLLIN|POLLRDNORM;
+	return ret;
+}
+
+/* Forward the wake ups of log_wait to one member of the group */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+static int
+secure_log_group_wake(wait_queue_entry_t *wait, unsigned int mode, int sync,
+		      void *key)
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0) */
+static int
+secure_log_group_wake(wait_queue_t *wait, unsigned int mode, int sync,
+		      void *key)
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(4, 13, 0) */
+{
+	struct log_group *group = container_of(wait, struct log_group, forward);
+
+	wake_up_interruptible(&group->wait);
+	return 0;
+}
+
+/*
+ * Make the reader a member of the group 'name', creating it (at the
+ * position of the reader) if needed. Otherwise, the own position of the
+ * reader and what it read but did not return yet are forgotten.
+ * Called with data->lock held.
+ */
+static int
+secure_log_join_group(struct user_data *data, const char *name)
+{
+	struct log_reader *reader = secure_log_reader(data);
+	struct log_group *group;
+
+	if (data->group != NULL)
+		return -EBUSY;
+
+	mutex_lock(&log_groups_mutex);
+	list_for_each_entry(group, &log_groups, list) {
+		if (strcmp(group->name, name) != 0)
+			continue;
+		/* All the members must read the same buffers */
+		if (group->reader->first_ring != reader->first_ring ||
+		    group->reader->end_ring != reader->end_ring) {
+			mutex_unlock(&log_groups_mutex);
+			return -EINVAL;
+		}
+		group->members++;
+		mutex_unlock(&log_groups_mutex);
+		/* log_stats_show may be looking at our position */
+		mutex_lock(&log_readers_mutex);
+		rcu_assign_pointer(data->reader, group->reader);
+		mutex_unlock(&log_readers_mutex);
+		/* So may secure_log_poll, without data->lock */
+		synchronize_rcu();
+		secure_log_reader_free(reader);
+		data->pending = 0;
+		data->fetched = 0;
+		WRITE_ONCE(data->group, group);
+		return 0;
+	}
+
+	group = kmalloc(sizeof(*group), GFP_KERNEL);
+	if (unlikely(group == NULL)) {
+		mutex_unlock(&log_groups_mutex);
+		return -ENOMEM;
+	}
+	strlcpy(group->name, name, sizeof(group->name));
+	group->members = 1;
+	group->reader = reader;
+	init_waitqueue_head(&group->wait);
+	init_waitqueue_func_entry(&group->forward, secure_log_group_wake);
+	add_wait_queue(&log_wait, &group->forward);
+	list_add(&group->list, &log_groups);
+	mutex_unlock(&log_groups_mutex);
+	WRITE_ONCE(data->group, group);
+	return 0;
+}
+
+/* The last member of a group destroys it */
+static void
+secure_log_leave_group(struct log_group *group)
+{
+	mutex_lock(&log_groups_mutex);
+	if (--group->members > 0) {
+		mutex_unlock(&log_groups_mutex);
+		return;
+	}
+	list_del(&group->list);
+	mutex_unlock(&log_groups_mutex);
+
+	remove_wait_queue(&log_wait, &group->forward);
+	secure_log_reader_free(group->reader);
+	kfree(group);
+}
+
+static int
+secure_log_open(struct inode *inode, struct file *file)
+{
+	struct user_data *data;
+	struct log_reader *reader;
+	unsigned int minor = iminor(inode) - MINOR(secure_dev);
+	unsigned int nr_type_rings = log_nr_rings / LOG_NR_TYPES;
+
+	/* Allocate private data */
+	data = kmalloc(sizeof(*data), GFP_KERNEL);
+	if (unlikely(data == NULL))
+		return -ENOMEM;
+
+	/* /dev/secure_log_<type> only reads the buffers of that type, see
+	 * init_secure_dev */
+	if (minor == 0)
+		reader = secure_log_reader_alloc(0, log_nr_rings);
+	else
+		reader = secure_log_reader_alloc((minor - 1) * nr_type_rings,
+						 minor * nr_type_rings);
+	if (unlikely(reader == NULL)) {
+		kfree(data);
+		return -ENOMEM;
+	}
+	RCU_INIT_POINTER(data->reader, reader);
+	data->group = NULL;
+
+	/* Initialize read mutex */
+	mutex_init(&data->lock);
+	data->pending = 0;
+	data->pending_path = 0;
+	data->fetched = 0;
+	data->filtered = 0;
+	bitmap_zero(data->paths_sent, LOG_PATHS_MAX + 1);
+	memset(data->latency, 0, sizeof(data->latency));
+	memset(&reader->gap, 0, sizeof(reader->gap));
+	data->nr_lost = 0;
+	data->nr_gaps = 0;
+
+	/* Wake up on every record by default */
+	spin_lock_init(&data->wakeup_lock);
+	data->wakeup_events = 1;
+	data->wakeup_bytes = 0;
+	data->wakeup_timeout = 0;
+	data->wakeup_expired = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+	timer_setup(&data->wakeup_timer, secure_log_wakeup_timer, 0);
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0) */
+	setup_timer(&data->wakeup_timer, secure_log_wakeup_timer,
+		    (unsigned long)data);
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(4, 15, 0) */
+
+	/* Set the format. These are plain integers: the parameters lock is
+	 * not needed to read them, and it is held by resizes for a while */
+	data->simple_format = !!READ_ONCE(simple_format);
+	data->send_eof = !!READ_ONCE(send_eof);
+	data->binary_format = !!READ_ONCE(binary_format);
+	data->octet_counting = !!READ_ONCE(octet_counting);
+
+	/* Get current state: only the first reader gets the old records */
+	secure_log_set_cursors(reader, !xchg(&first_read, 0));
+
+
+	/* Store private data */
+	file->private_data = data;
+
+	data->pid = current->tgid;
+	mutex_lock(&log_readers_mutex);
+	list_add_tail(&data->list, &log_readers);
+	mutex_unlock(&log_readers_mutex);
+	return 0;
+}
+
+static int
+secure_log_release(struct inode *inode, struct file *file)
+{
+	struct user_data *data = file->private_data;
+
+	if (data == NULL)
+		return 0;
+
+	mutex_lock(&log_readers_mutex);
+	list_del(&data->list);
+	mutex_unlock(&log_readers_mutex);
+	del_timer_sync(&data->wakeup_timer);
+	if (data->group)
+		secure_log_leave_group(data->group);
+	else
+		/* Nobody else uses the file anymore */
+		secure_log_reader_free(rcu_dereference_protected(data->reader,
+								 true));
+	mutex_destroy(&data->lock);
+	kfree(data);
+
+	return 0;
+}
+
+
+static long
+secure_log_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct user_data *data = file->private_data;
+	void __user *argp = (void __user *)arg;
+	struct secure_log_stats stats;
+	struct secure_log_wakeup wakeup;
+	struct secure_log_filter filter;
+	struct secure_log_group group;
+	struct secure_log_path __user *upath = argp;
+	struct secure_log_latency latency;
+	struct log_path *path;
+	__u64 value;
+	__u32 id;
+	int err;
+
+	if (unlikely(data == NULL))
+		return -EBADF;
+
+	switch (cmd) {
+	case SECURE_LOG_IOC_SEEK_NSEC:
+		if (copy_from_user(&value, argp, sizeof(value)))
+			return -EFAULT;
+		return secure_log_seek(data, LOG_SEEK_NSEC, value);
+	case SECURE_LOG_IOC_GET_STATS:
+		memset(&stats, 0, sizeof(stats));
+		stats.overwritten = log_overwritten();
+		err = mutex_lock_interruptible(&data->lock);
+		if (err)
+			return err;
+		stats.lost = data->nr_lost;
+		stats.gaps = data->nr_gaps;
+		mutex_unlock(&data->lock);
+		if (copy_to_user(argp, &stats, sizeof(stats)))
+			return -EFAULT;
+		return 0;
+	case SECURE_LOG_IOC_SET_WAKEUP:
+		if (copy_from_user(&wakeup, argp, sizeof(wakeup)))
+			return -EFAULT;
+		/* Readers must be woken up somehow */
+		if (wakeup.events == 0 && wakeup.bytes == 0 &&
+		    wakeup.timeout_ms == 0)
+			return -EINVAL;
+		spin_lock(&data->wakeup_lock);
+		data->wakeup_events = wakeup.events;
+		data->wakeup_bytes = wakeup.bytes;
+		data->wakeup_timeout = msecs_to_jiffies(wakeup.timeout_ms);
+		spin_unlock(&data->wakeup_lock);
+		secure_log_wakeup_reset(data);
+		/* Let the waiting threads check the new policy */
+		secure_log_wake_reader(data);
+		return 0;
+	case SECURE_LOG_IOC_SET_FILTER:
+		if (copy_from_user(&filter, argp, sizeof(filter)))
+			return -EFAULT;
+		if (filter.path_len > sizeof(filter.path) ||
+		    (filter.flags & ~SECURE_LOG_FILTER_ALL) ||
+		    ((filter.flags & SECURE_LOG_FILTER_UID) &&
+		     filter.uid_min > filter.uid_max) ||
+		    ((filter.flags & SECURE_LOG_FILTER_GID) &&
+		     filter.gid_min > filter.gid_max))
+			return -EINVAL;
+		err = mutex_lock_interruptible(&data->lock);
+		if (err)
+			return err;
+		data->filter = filter;
+		data->filtered = filter.types || filter.flags ||
+				 filter.protocols || filter.actions ||
+				 filter.path_len;
+		/* The record already fetched may not match anymore, it is
+		 * returned anyway: the filter applies to the next ones */
+		mutex_unlock(&data->lock);
+		secure_log_wake_reader(data);
+		return 0;
+	case SECURE_LOG_IOC_JOIN_GROUP:
+		if (copy_from_user(&group, argp, sizeof(group)))
+			return -EFAULT;
+		if (group.name[0] == '\0' ||
+		    group.name[sizeof(group.name) - 1] != '\0')
+			return -EINVAL;
+		err = mutex_lock_interruptible(&data->lock);
+		if (err)
+			return err;
+		err = secure_log_join_group(data, group.name);
+		mutex_unlock(&data->lock);
+		return err;
+	case SECURE_LOG_IOC_GET_LATENCY:
+		BUILD_BUG_ON(SECURE_LOG_LATENCY_BUCKETS != LOG_HIST_BUCKETS);
+		err = mutex_lock_interruptible(&data->lock);
+		if (err)
+			return err;
+		memcpy(latency.buckets, data->latency, sizeof(latency.buckets));
+		mutex_unlock(&data->lock);
+		if (copy_to_user(argp, &latency, sizeof(latency)))
+			return -EFAULT;
+		return 0;
+	case SECURE_LOG_IOC_GET_PATH:
+		if (get_user(id, &upath->id))
+			return -EFAULT;
+		path = log_path_get(id);
+		if (path == NULL)
+			return -ENOENT;
+		if (put_user(path->len - 1, &upath->len) ||
+		    copy_to_user(upath->path, path->path, path->len))
+			return -EFAULT;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+#ifdef CONFIG_COMPAT
+static long
+secure_log_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	/* All our arguments have the same layout on 32 and 64 bits */
+	return secure_log_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif /* CONFIG_COMPAT */
+
+
+/* Kernel address of the page at 'offset' in the mmap() view, with
+ * log_resize_mutex held */
+static void *
+secure_log_mmap_addr(unsigned long offset)
+{
+	const struct secure_log_mmap_ring *pos;
+	unsigned int i;
+
+	if (offset < log_mmap_header_size)
+		return ((char *)log_mmap_header) + offset;
+	/* The buffers may not all have the same size */
+	for (i = 0; i < log_nr_rings; ++i) {
+		pos = &log_mmap_header->rings[i];
+		if (offset - pos->offset < pos->size)
+			return log_rings[i]->buf + (offset - pos->offset);
+	}
+	return NULL;
+}
+
+static int
+secure_log_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	unsigned long size = vma->vm_end - vma->vm_start;
+	unsigned long total, offset, addr;
+	void *page;
+	int err;
+
+	/* The buffers can only be read */
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	/* vm_flags can only be changed through these helpers */
+	vm_flags_clear(vma, VM_MAYWRITE);
+	vm_flags_set(vma, VM_DONTEXPAND);
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(6, 3, 0) */
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND;
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(6, 3, 0) */
+
+	/* The buffers must not be replaced meanwhile */
+	mutex_lock(&log_resize_mutex);
+
+	total = log_mmap_size;
+	err = -EINVAL;
+	if (vma->vm_pgoff > (total >> PAGE_SHIFT))
+		goto out;
+	offset = vma->vm_pgoff << PAGE_SHIFT;
+	if (size > total - offset)
+		goto out;
+
+	/* Buffers are allocated with vmalloc, map them page per page */
+	err = 0;
+	for (addr = vma->vm_start; addr < vma->vm_end; addr += PAGE_SIZE) {
+		page = secure_log_mmap_addr(offset);
+		if (WARN_ON(page == NULL)) {
+			err = -EINVAL;
+			break;
+		}
+		err = vm_insert_page(vma, addr, vmalloc_to_page(page));
+		if (err)
+			break;
+		offset += PAGE_SIZE;
+	}
+out:
+	mutex_unlock(&log_resize_mutex);
+	return err;
+}
+
+
+static const struct file_operations secure_log_fops = {
+	.owner = THIS_MODULE,
+	.open = secure_log_open,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+	.read_iter = secure_log_read_iter,
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(3, 16, 0) */
+	.read = secure_log_read,
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(3, 16, 0) */
+	/* Records are formatted straight into the pages of the pipe. Older
+	 * kernels fall back to default_file_splice_read, through read() */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.splice_read = copy_splice_read,
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0)
+	.splice_read = generic_file_splice_read,
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(6, 5, 0) */
+	.llseek = secure_log_llseek,
+	.poll = secure_log_poll,
+	.mmap = secure_log_mmap,
+	.unlocked_ioctl = secure_log_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = secure_log_compat_ioctl,
+#endif /* CONFIG_COMPAT */
+	.release = secure_log_release,
+};
+
+
+/*
+ * Statistics, in <debugfs>/secure_log/stats: one "name value" per line,
+ * histograms being printed as "name <upper bound> count" for each bucket
+ * which is not empty.
+ */
+static struct dentry *log_debugfs;
+
+static void
+log_stats_hist(struct seq_file *m, const char *name, const u64 *hist)
+{
+	unsigned int i;
+
+	for (i = 0; i < LOG_HIST_BUCKETS; ++i)
+		if (hist[i])
+			seq_printf(m, "%s %llu %llu\n", name,
+				   i < LOG_HIST_BUCKETS - 1 ? 1ULL << i : ~0ULL,
+				   (unsigned long long)hist[i]);
+}
+
+static int
+log_stats_show(struct seq_file *m, void *v)
+{
+	struct log_stats *stats, *cpu_stats;
+	struct log_ring_pos pos;
+	struct user_data *data;
+	struct log_reader *reader;
+	u64 records, bytes, used, missed;
+	unsigned int i, type, nr_readers = 0;
+	char name[32];
+	int cpu;
+
+	stats = kzalloc(sizeof(*stats), GFP_KERNEL);
+	if (stats == NULL)
+		return -ENOMEM;
+	for_each_possible_cpu(cpu) {
+		cpu_stats = per_cpu_ptr(&log_stats, cpu);
+		for (type = 0; type < LOG_NR_TYPES; ++type)
+			stats->stored[type] += cpu_stats->stored[type];
+		stats->bytes += cpu_stats->bytes;
+		stats->coalesced += cpu_stats->coalesced;
+		stats->truncated_paths += cpu_stats->truncated_paths;
+		stats->truncated_argv += cpu_stats->truncated_argv;
+		for (i = 0; i < LOG_HIST_BUCKETS; ++i) {
+			stats->lock_wait[i] += cpu_stats->lock_wait[i];
+			stats->lock_hold[i] += cpu_stats->lock_hold[i];
+		}
+	}
+
+	for (type = 0; type < LOG_NR_TYPES; ++type)
+		seq_printf(m, "stored_%s %llu\n", get_module_name(type),
+			   (unsigned long long)stats->stored[type]);
+	seq_printf(m, "stored_bytes %llu\n", (unsigned long long)stats->bytes);
+	seq_printf(m, "overwritten %llu\n",
+		   (unsigned long long)log_overwritten());
+	seq_printf(m, "coalesced %llu\n",
+		   (unsigned long long)stats->coalesced);
+	seq_printf(m, "truncated_paths %llu\n",
+		   (unsigned long long)stats->truncated_paths);
+	seq_printf(m, "truncated_argv %llu\n",
+		   (unsigned long long)stats->truncated_argv);
+	seq_printf(m, "resize_dropped %llu\n",
+		   (unsigned long long)READ_ONCE(log_resize_dropped));
+	if (cold_size) {
+		missed = 0;
+		for (i = 0; i < log_nr_rings; ++i)
+			missed += READ_ONCE(log_rings[i]->cold->missed);
+		seq_printf(m, "cold_missed %llu\n", (unsigned long long)missed);
+	}
+
+	/* Buffers, in the same order as in the mmap() view */
+	for (i = 0; i < log_nr_rings; ++i) {
+		log_ring_get_pos(log_rings[i], &pos);
+		if (pos.next_seq == pos.first_seq)
+			used = 0;
+		else if (pos.next_idx > pos.first_idx)
+			used = pos.next_idx - pos.first_idx;
+		else
+			used = pos.size - pos.first_idx + pos.next_idx;
+		seq_printf(m, "ring%u size %u used %llu first_seq %llu next_seq %llu\n",
+			   i, pos.size, (unsigned long long)used,
+			   (unsigned long long)pos.first_seq,
+			   (unsigned long long)pos.next_seq);
+	}
+
+	/* Lag of each reader: records and bytes it has not read yet */
+	mutex_lock(&log_readers_mutex);
+	list_for_each_entry(data, &log_readers, list) {
+		records = 0;
+		bytes = 0;
+		/* Joining a group replaces it under log_readers_mutex */
+		reader = rcu_dereference_protected(data->reader,
+				lockdep_is_held(&log_readers_mutex));
+		spin_lock(&reader->lock);
+		for (i = reader->first_ring; i < reader->end_ring; ++i)
+			log_ring_backlog(log_rings[i], &reader->cursors[i],
+					 &records, &bytes);
+		spin_unlock(&reader->lock);
+		seq_printf(m, "reader%u pid %d group %s lag_records %llu lag_bytes %llu lost %llu\n",
+			   nr_readers++, data->pid,
+			   data->group ? data->group->name : "-",
+			   (unsigned long long)records,
+			   (unsigned long long)bytes,
+			   (unsigned long long)data->nr_lost);
+		snprintf(name, sizeof(name), "reader%u_latency_ns",
+			 nr_readers - 1);
+		log_stats_hist(m, name, data->latency);
+	}
+	mutex_unlock(&log_readers_mutex);
+	seq_printf(m, "readers %u\n", nr_readers);
+
+	log_stats_hist(m, "lock_wait_ns", stats->lock_wait);
+	log_stats_hist(m, "lock_hold_ns", stats->lock_hold);
+	kfree(stats);
+	return 0;
+}
+
+static int
+log_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, log_stats_show, NULL);
+}
+
+static const struct file_operations log_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = log_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+
+/*
+ * Lay the buffers out in the mmap() view, after the header, and tell the
+ * readers where they are. Called once the buffers are allocated, and by
+ * log_resize with log_resize_mutex held.
+ */
+static void
+log_mmap_layout(void)
+{
+	struct secure_log_mmap_ring *pos;
+	unsigned long offset = log_mmap_header_size;
+	u32 ring_size = log_rings[0]->size;
+	unsigned int i;
+
+	for (i = 0; i < log_nr_rings; ++i) {
+		pos = &log_mmap_header->rings[i];
+		WRITE_ONCE(pos->offset, offset);
+		WRITE_ONCE(pos->size, log_rings[i]->size);
+		if (log_rings[i]->size != ring_size)
+			ring_size = 0;
+		offset += log_rings[i]->size;
+	}
+	WRITE_ONCE(log_mmap_header->ring_size, ring_size);
+	log_mmap_size = offset;
+}
+
+/* Buffers are mapped into userspace: never leak old memory */
+static char *
+log_buf_alloc(unsigned int size, int node)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+	/* Big buffers are better backed by huge pages, which can't be
+	 * requested on a given node */
+	if (node == NUMA_NO_NODE)
+		return vmalloc_huge(size, GFP_KERNEL | __GFP_ZERO);
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0) */
+	return vzalloc_node(size, node);
+}
+
+/* Wait for all the producers which are between log_reserve and log_commit */
+static inline void
+log_synchronize_producers(void)
+{
+	/* They run with preemption disabled */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	synchronize_rcu();
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0) */
+	synchronize_sched();
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(4, 20, 0) */
+}
+
+/* Index of a 'size' bytes buffer */
+static struct log_index_entry *
+log_index_alloc(unsigned int size, int node)
+{
+	return vzalloc_node(log_index_len(size) * sizeof(struct log_index_entry),
+			    node);
+}
 
-static size_t
-execlog_print(struct execlog_log *record, char *data, size_t len)
-__must_hold(log_lock)
+/*
+ * Resizes copy the records into the new buffers while the producers keep
+ * writing into the old ones, checking afterwards that they were not
+ * overwritten meanwhile, like the readers. The producers are then only
+ * stopped to copy the records stored since, which are few: the records
+ * they drop in the meantime are reported by a gap record.
+ */
+#define LOG_MOVE_TRIES 4
+
+struct log_move {
+	struct log_ring *src /** Buffer being resized */;
+	struct log_ring ring /** New buffer, private until log_move_switch */;
+	struct secure_log_mmap_ring mmap_pos /** Positions of the new buffer, never mapped */;
+	u64 count[LOG_NR_TYPES] /** Number of records of each type before ring.next_seq */;
+	u32 src_idx /** Index of the record ring.next_seq in the old buffer */;
+	u64 stop_nsec /** When the producers were stopped */;
+	u64 lost /** Records dropped while they were stopped */;
+};
+
+/* Start the copy again from the oldest record of the old buffer */
+static void
+log_move_reset(struct log_move *move, const struct log_ring_pos *pos)
 {
-	size_t remaining = USER_BUFFER_SIZE - len;
-	long change;
+	struct log_ring *ring = &move->ring;
 
-	if (WARN_ON(record->header.len < sizeof(struct execlog_log))) {
-		change = snprintf(data + len, remaining, "BROKEN RECCORD");
-		UPDATE_POINTERS(change, remaining, len);
-		return len;
-	}
+	ring->first_seq = pos->first_seq;
+	ring->first_idx = 0;
+	ring->next_seq = pos->first_seq;
+	ring->next_idx = 0;
+	memcpy(ring->dropped, pos->dropped, sizeof(ring->dropped));
+	ring->last_dropped_nsec = pos->last_dropped_nsec;
+	memcpy(move->count, pos->dropped, sizeof(move->count));
+	memset(ring->index, 0, ring->index_len * sizeof(*ring->index));
+	move->src_idx = pos->first_idx;
+}
 
-	change = snprintf(data + len, remaining, "%.*s %.*s",
-			  (int) record->path_len, get_execlog_path(record),
-			  (int) record->argv_len, get_execlog_argv(record));
-	UPDATE_POINTERS(change, remaining, len);
-	return len;
+static int
+log_move_init(struct log_move *move, struct log_ring *src, unsigned int size)
+{
+	struct log_ring *ring = &move->ring;
+	struct log_ring_pos pos;
+
+	move->src = src;
+	ring->buf = log_buf_alloc(size, src->node);
+	ring->index = log_index_alloc(size, src->node);
+	if (ring->buf == NULL || ring->index == NULL)
+		return -ENOMEM;
+	ring->size = size;
+	ring->index_len = log_index_len(size);
+	ring->node = src->node;
+	seqcount_init(&ring->pos_seq);
+	ring->mmap_pos = &move->mmap_pos;
+
+	log_ring_get_pos(src, &pos);
+	log_move_reset(move, &pos);
+	return 0;
 }
 
-static inline char *
-get_module_name(enum secure_log_type type)
+/*
+ * Append the records of the old buffer following those already copied,
+ * up to 'end'. The oldest records are dropped from the new buffer if they
+ * don't fit anymore. Unless 'stopped' is set, the producers may overwrite
+ * the records meanwhile.
+ * Returns -EAGAIN if some of them were, the copy must then be reset.
+ */
+static int
+log_move_copy(struct log_move *move, u64 end, bool stopped)
 {
-	switch (type) {
-	case LOG_NETWORK_INTERACTION:
-		return "netlog";
-	case LOG_EXECUTION:
-		return "execlog";
-	default:
-		return "unknown";
+	struct log_ring *ring = &move->ring;
+	struct log_ring_pos pos;
+	struct sec_log *src, *dst;
+	size_t len;
+	u32 idx;
+
+	log_ring_get_pos(move->src, &pos);
+	while (ring->next_seq < end) {
+		if (unlikely(ring->next_seq < pos.first_seq))
+			return -EAGAIN;
+		idx = move->src_idx;
+		if (unlikely(idx > pos.size - sizeof(struct sec_log)))
+			return -EAGAIN;
+		src = (struct sec_log *)(pos.buf + idx);
+		if (READ_ONCE(src->len) == 0) {
+			idx = 0;
+			src = (struct sec_log *)pos.buf;
+		}
+		/* Copied once committed, by the next pass */
+		if (!READ_ONCE(src->committed))
+			break;
+		smp_rmb();
+		len = READ_ONCE(src->len);
+		if (unlikely(len < sizeof(struct sec_log) ||
+			     len > pos.size - idx ||
+			     len + sizeof(struct sec_log) >= ring->size >> 1))
+			return -EAGAIN;
+
+		/* Nobody else knows about the new buffer */
+		__acquire(log_lock);
+		dst = find_new_record_place(ring, len);
+		__release(log_lock);
+		if (WARN_ON(dst == NULL))
+			return -EAGAIN;
+		memcpy(dst, src, len);
+		dst->len = len;
+
+		if (!stopped) {
+			/* Make sure that it was not overwritten meanwhile */
+			smp_rmb();
+			log_ring_get_pos(move->src, &pos);
+			if (unlikely(ring->next_seq < pos.first_seq))
+				return -EAGAIN;
+		}
+
+		if (LOG_INDEXED(ring->next_seq))
+			log_index_add(ring->index, ring->index_len,
+				      ring->next_seq, dst->seq,
+				      dst->process.nsec,
+				      (u32)((char *)dst - ring->buf),
+				      move->count);
+		if (likely(dst->type < LOG_NR_TYPES))
+			move->count[dst->type]++;
+		ring->next_idx += (u32)len;
+		ring->next_seq++;
+		move->src_idx = idx + (u32)len;
+		if (!stopped)
+			cond_resched();
 	}
+	return 0;
 }
 
-static inline size_t
-secure_log_read_fill_record(char *buf, size_t len, struct sec_log *record)
-__must_hold(log_lock)
+/* Copy the records of the old buffer without stopping the producers */
+static void
+log_move_live(struct log_move *move)
 {
-	/* Fill the common header 'len' here is only set to the headers, it
-	 * can't overflow here*/
-	len += SPRINTF(buf + len, CURRENT_DETAILS_FORMAT " ",
-		       CURRENT_DETAILS_ARGS(record->process));
+	struct log_ring_pos pos;
+	int tries;
 
-	/* Print the content */
-	switch (record->type) {
-	case LOG_NETWORK_INTERACTION:
-		len = netlog_print((struct netlog_log *)record, buf, len);
-		break;
-	case LOG_EXECUTION:
-		len = execlog_print((struct execlog_log *)record, buf, len);
-		break;
-	default:
-		/* We can't overflow here as only static headers have been
-		 * written up to here */
-		len += SPRINTF(buf + len, "Unknown entry");
-	}
-	if (len == 0) {
-		sprintf(buf + (USER_BUFFER_SIZE - 7), "TRUNC");
-		len = USER_BUFFER_SIZE - 2;
+	for (tries = 0; tries < LOG_MOVE_TRIES; ++tries) {
+		log_ring_get_pos(move->src, &pos);
+		/* The last record may still be coalesced into */
+		if (pos.next_seq == 0 ||
+		    log_move_copy(move, pos.next_seq - 1, false) == 0)
+			return;
+		/* The producers overtook us, start from their oldest record */
+		log_ring_get_pos(move->src, &pos);
+		log_move_reset(move, &pos);
 	}
-	len += SPRINTF(buf + len, "\n");
-
-	return len;
 }
 
-static ssize_t
-secure_log_read(struct file *file, char __user *buf, size_t count,
-		loff_t *offset)
+/* Copy the remaining records, the producers are stopped */
+static void
+log_move_finish(struct log_move *move)
 {
-	struct user_data *data = file->private_data;
-	struct sec_log *record;
-	u64 ts;
-	unsigned long rem_nsec;
-	unsigned long flags;
-	size_t len;
-	ssize_t err, ret;
+	struct log_ring_pos pos;
 
-	if (unlikely(data == NULL))
-		return -EBADF;
+	log_ring_get_pos(move->src, &pos);
+	if (log_move_copy(move, pos.next_seq, true) == 0)
+		return;
+	/* Overwritten before we stopped them, copy everything again */
+	log_move_reset(move, &pos);
+	WARN_ON(log_move_copy(move, pos.next_seq, true));
+}
 
-	/* Is the user already reading ? */
-	err = mutex_lock_interruptible(&data->lock);
-	if (err)
-		return err;
+/*
+ * Make the new buffer the one of the ring, and store a gap record for the
+ * records dropped while the producers were stopped. The old buffer is
+ * left in the move, to be freed.
+ */
+static void
+log_move_switch(struct log_move *move)
+__must_hold(log_lock)
+{
+	struct log_ring *ring = move->src;
+	struct log_ring *new = &move->ring;
+	struct gap_log *gap;
+	unsigned int type;
+	u64 now;
 
-	spin_lock_irqsave(&log_lock, flags);
-	/* Wait until we have something to read */
-	while (data->log_curr_seq == log_next_seq) {
-		/* Too bad, this call cannot be non-blocking */
-		if (file->f_flags & O_NONBLOCK) {
-			ret = -EAGAIN;
-			spin_unlock_irqrestore(&log_lock, flags);
-			goto out;
-		}
+	log_ring_pos_begin(ring);
+	swap(ring->buf, new->buf);
+	swap(ring->size, new->size);
+	swap(ring->index, new->index);
+	swap(ring->index_len, new->index_len);
+	ring->generation++;
+	ring->first_seq = new->first_seq;
+	ring->first_idx = new->first_idx;
+	ring->next_idx = new->next_idx;
+	memcpy(ring->dropped, new->dropped, sizeof(ring->dropped));
+	ring->last_dropped_nsec = new->last_dropped_nsec;
+	/* The records moved, don't coalesce with them */
+	ring->last_seq = LOG_SEQ_NONE;
+	ring->repeat_seq = LOG_SEQ_NONE;
+	log_ring_pos_end(ring);
 
-		/* The caller asked for a EOF */
-		if (data->send_eof) {
-			ret = 0;
-			spin_unlock_irqrestore(&log_lock, flags);
-			goto out;
+	move->lost = 0;
+	for (type = 0; type < LOG_NR_TYPES; ++type)
+		move->lost += ring->resize_lost[type];
+	if (move->lost != 0) {
+		now = log_ring_clock(ring);
+		gap = (struct gap_log *)find_new_record_place(ring,
+			ALIGN(sizeof(*gap), LOG_ALIGN));
+		/* All the records are committed */
+		if (!WARN_ON(gap == NULL)) {
+			memset(gap, 0, sizeof(*gap));
+			gap->header.len = ALIGN(sizeof(*gap), LOG_ALIGN);
+			gap->header.seq = log_record_seq(ring);
+			gap->header.type = LOG_GAP;
+			gap->header.committed = 1;
+			gap->header.process.nsec = now;
+			memcpy(gap->lost, ring->resize_lost, sizeof(gap->lost));
+			gap->after_nsec = move->stop_nsec;
+			gap->until_nsec = now;
+			if (LOG_INDEXED(ring->next_seq))
+				log_index_add(ring->index, ring->index_len,
+					      ring->next_seq, gap->header.seq, now,
+					      (u32)((char *)gap - ring->buf),
+					      ring->stored);
+			/* Gap records are not counted in ring->stored */
+			log_ring_pos_begin(ring);
+			ring->next_idx += (u32)gap->header.len;
+			ring->next_seq++;
+			log_ring_pos_end(ring);
 		}
+		memset(ring->resize_lost, 0, sizeof(ring->resize_lost));
+	}
 
-		/* We need to wait, unlock */
-		spin_unlock_irqrestore(&log_lock, flags);
-		ret = wait_event_interruptible(log_wait,
-				data->log_curr_seq != log_next_seq);
-		if (ret)
-			goto out;
+	/* Pairs with log_reserve */
+	smp_wmb();
+	WRITE_ONCE(ring->resizing, 0);
+}
+
+static void
+log_move_switch_ipi(void *info)
+{
+	/* Per-CPU buffers are locked by disabling interrupts */
+	__acquire(log_lock);
+	log_move_switch(info);
+	__release(log_lock);
+}
+
+/* Switch to the new buffer, from the CPU writing into it if any */
+static void
+log_move_commit(struct log_move *move)
+{
+	unsigned long flags;
+	int cpu = move->src->cpu;
+
+	if (cpu < 0) {
 		spin_lock_irqsave(&log_lock, flags);
+		log_move_switch(move);
+		spin_unlock_irqrestore(&log_lock, flags);
+		return;
 	}
+	if (cpu_online(cpu) &&
+	    smp_call_function_single(cpu, log_move_switch_ipi, move, 1) == 0)
+		return;
+	/* Nobody writes into the buffer of an offline CPU */
+	local_irq_save(flags);
+	log_move_switch_ipi(move);
+	local_irq_restore(flags);
+}
 
-	/* Perhaps we waited for too long and some data is lost */
-	if (unlikely(data->log_curr_seq < log_first_seq)) {
-		/* Rest the position and alert the user */
-		data->log_curr_seq = log_first_seq;
-		data->log_curr_idx = log_first_idx;
-		spin_unlock_irqrestore(&log_lock, flags);
-		ret = -EPIPE;
+/*
+ * Replace all the buffers by 'size' bytes ones, keeping their content.
+ * Records stored while the producers are stopped are dropped, and reported
+ * to the readers as such.
+ */
+static int
+log_resize(unsigned int size)
+{
+	struct log_move *moves;
+	unsigned int i, pass;
+	u64 lost = 0, now;
+	int err = 0;
+
+	mutex_lock(&log_resize_mutex);
+	if (size == log_buf_len)
 		goto out;
-	}
 
-	/* Get the current record */
-	record = (struct sec_log *)(log_buf + data->log_curr_idx);
-	if (record->len == 0) {
-		/* We have cycled back to the start */
-		record = (struct sec_log *)(log_buf);
+	moves = vzalloc(log_nr_rings * sizeof(*moves));
+	if (moves == NULL) {
+		err = -ENOMEM;
+		goto out;
 	}
-
-	ts = record->process.nsec;
-	rem_nsec = do_div(ts, 1000000000);
-	if (data->simple_format == 0) {
-		/* Fill the syslog header */
-		len = SPRINTF(data->buf, "<%u>1 - - %s - - - [%5lu.%06lu]: ",
-			      (LOG_FACILITY << 3) | LOG_LEVEL,
-			      get_module_name(record->type),
-			      (unsigned long)ts, rem_nsec / 1000);
-	} else {
-		/* Use a simpler header */
-		len = SPRINTF(data->buf, "%s [%5lu.%06lu]: ",
-			      get_module_name(record->type),
-			      (unsigned long)ts, rem_nsec / 1000);
+	for (i = 0; i < log_nr_rings; ++i) {
+		err = log_move_init(&moves[i], log_rings[i], size);
+		if (err < 0)
+			goto free;
 	}
 
-	len = secure_log_read_fill_record(data->buf, len, record);
-
-	/* Prepare for next iteration */
-	data->log_curr_idx = next_record(data->log_curr_idx);
-	++data->log_curr_seq;
+	/* The second pass only copies the records stored during the first */
+	for (pass = 0; pass < 2; ++pass)
+		for (i = 0; i < log_nr_rings; ++i)
+			log_move_live(&moves[i]);
 
-	/* Unlock */
-	spin_unlock_irqrestore(&log_lock, flags);
+	/* Stop the producers, and wait for those which already reserved
+	 * a record to commit it */
+	now = local_clock();
+	for (i = 0; i < log_nr_rings; ++i) {
+		moves[i].stop_nsec = now;
+		WRITE_ONCE(log_rings[i]->resizing, 1);
+	}
+	log_synchronize_producers();
 
-	/* The user buffer is too small, abort */
-	if (unlikely(len > count)) {
-		ret = -EINVAL;
-		goto out;
+	for (i = 0; i < log_nr_rings; ++i)
+		log_move_finish(&moves[i]);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	cpus_read_lock();
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0) */
+	get_online_cpus();
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(4, 13, 0) */
+	for (i = 0; i < log_nr_rings; ++i) {
+		log_move_commit(&moves[i]);
+		lost += moves[i].lost;
 	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	cpus_read_unlock();
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0) */
+	put_online_cpus();
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(4, 13, 0) */
+	log_mmap_layout();
+	WRITE_ONCE(log_buf_len, size);
+	WRITE_ONCE(log_resize_dropped, lost);
+	dev_info(dev, "Buffers resized to %u bytes, %llu records dropped meanwhile\n",
+		 size, (unsigned long long)lost);
+	/* Let the readers know about the gap records */
+	if (lost != 0)
+		wake_up_interruptible(&log_wait);
 
-	/* Copy the data into userspace */
-	if (unlikely(copy_to_user(buf, data->buf, len))) {
-		/* Copy failed */
-		ret = -EFAULT;
-		goto out;
+	/* Readers may still be using the old buffers */
+	synchronize_rcu();
+free:
+	for (i = 0; i < log_nr_rings; ++i) {
+		vfree(moves[i].ring.buf);
+		vfree(moves[i].ring.index);
 	}
-	/* len < USER_BUFFER_SIZE, can't overflow */
-	ret = (ssize_t)len;
+	vfree(moves);
 out:
-	mutex_unlock(&data->lock);
-	return ret;
+	mutex_unlock(&log_resize_mutex);
+	return err;
 }
 
-static unsigned int
-secure_log_poll(struct file *file, poll_table *wait)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
+static int
+buffer_size_param_set(const char *buf, struct kernel_param *kp)
+#else /* LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 36) */
+static int
+buffer_size_param_set(const char *buf, const struct kernel_param *kp)
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(2, 6, 36) */
 {
-	struct user_data *data = file->private_data;
-	unsigned long flags;
-	unsigned int ret = 0;
+	unsigned long long size;
+	char *end;
 
-	if (unlikely(data == NULL))
-		return POLLERR|POLLNVAL;
+	/* Accept the usual K/M/G suffixes */
+	size = memparse(buf, &end);
+	if (end == buf || (*end != '\0' && *end != '\n'))
+		return -EINVAL;
+	if (size < LOG_BUF_LEN_MIN || size > LOG_BUF_LEN_MAX)
+		return -EINVAL;
+	/* Buffers are mapped page per page */
+	size = PAGE_ALIGN(size);
 
-	/* Update the poll state */
-	poll_wait(file, &log_wait, wait);
-
-	/* Check if there is anything to read */
-	spin_lock_irqsave(&log_lock, flags);
-	if (data->log_curr_seq < log_next_seq) {
-		/* Return error when data has vanished underneath us */
-		if (data->log_curr_seq < log_first_seq)
-			ret = POLLIN|POLLRDNORM|POLLERR|POLLPRI;
-		else
-			ret = POLLIN|POLLRDNORM;
+	/* Not loaded yet, the buffers will be allocated with this size */
+	if (log_rings == NULL) {
+		log_buf_len = (unsigned int)size;
+		return 0;
 	}
-	spin_unlock_irqrestore(&log_lock, flags);
-
-	return ret;
+	return log_resize((unsigned int)size);
 }
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
 static int
-secure_log_open(struct inode *inode, struct file *file)
+buffer_size_param_get(char *buffer, struct kernel_param *kp)
+#else /* LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 36) */
+static int
+buffer_size_param_get(char *buffer, const struct kernel_param *kp)
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(2, 6, 36) */
 {
-	struct user_data *data;
-	unsigned long flags;
+	return scnprintf(buffer, PAGE_SIZE, "%u", READ_ONCE(log_buf_len));
+}
 
-	/* Allocate private data */
-	data = kmalloc(sizeof(*data), GFP_KERNEL);
-	if (unlikely(data == NULL))
-		return -ENOMEM;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
+module_param_call(buffer_size, &buffer_size_param_set, &buffer_size_param_get, NULL, 0644);
+#else /* LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 36) */
+static const struct kernel_param_ops buffer_size_param = {
+	.set = buffer_size_param_set,
+	.get = buffer_size_param_get,
+};
+module_param_cb(buffer_size, &buffer_size_param, NULL, 0644);
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(2, 6, 36) */
+MODULE_PARM_DESC(buffer_size, "Size of each buffer, from 1M to 2G, can be changed at runtime (the content is kept)");
 
-	/* Initialize read mutex */
-	mutex_init(&data->lock);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
+static int
+overwritten_param_set(const char *buf, struct kernel_param *kp)
+#else /* LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 36) */
+static int
+overwritten_param_set(const char *buf, const struct kernel_param *kp)
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(2, 6, 36) */
+{
+	return -EPERM;
+}
 
-	/* Set the format */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
-	kernel_param_lock(THIS_MODULE);
-	data->simple_format = !!simple_format;
-	data->send_eof = !!send_eof;
-	kernel_param_unlock(THIS_MODULE);
-#else /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0) */
-	kparam_block_sysfs_write(simple_format);
-	data->simple_format = !!simple_format;
-	kparam_unblock_sysfs_write(simple_format);
-	kparam_block_sysfs_write(send_eof);
-	data->send_eof = !!send_eof;
-	kparam_unblock_sysfs_write(send_eof);
-#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(4, 2, 0) */
-
-	/* Get current state */
-	spin_lock_irqsave(&log_lock, flags);
-	if (first_read) {
-		data->log_curr_seq = log_first_seq;
-		data->log_curr_idx = log_first_idx;
-		first_read = 0;
-	} else {
-		data->log_curr_seq = log_next_seq;
-		data->log_curr_idx = log_next_idx;
-	}
-	spin_unlock_irqrestore(&log_lock, flags);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
+static int
+overwritten_param_get(char *buffer, struct kernel_param *kp)
+#else /* LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 36) */
+static int
+overwritten_param_get(char *buffer, const struct kernel_param *kp)
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(2, 6, 36) */
+{
+	return scnprintf(buffer, PAGE_SIZE, "%llu",
+			 (unsigned long long)log_overwritten());
+}
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2, 6, 36)
+module_param_call(overwritten, &overwritten_param_set, &overwritten_param_get, NULL, 0444);
+#else /* LINUX_VERSION_CODE > KERNEL_VERSION(2, 6, 36) */
+static const struct kernel_param_ops overwritten_param = {
+	.set = overwritten_param_set,
+	.get = overwritten_param_get,
+};
+module_param_cb(overwritten, &overwritten_param, NULL, 0444);
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(2, 6, 36) */
+MODULE_PARM_DESC(overwritten, "Number of records overwritten in the buffers before being read by every reader (read only)");
 
-	/* Store private data */
-	file->private_data = data;
 
+static int __init
+init_log_ring(struct log_ring *ring, int node)
+{
+	ring->buf = log_buf_alloc(log_buf_len, node);
+	if (ring->buf == NULL)
+		return -ENOMEM;
+	ring->index = log_index_alloc(log_buf_len, node);
+	if (ring->index == NULL) {
+		vfree(ring->buf);
+		ring->buf = NULL;
+		return -ENOMEM;
+	}
+	ring->index_len = log_index_len(log_buf_len);
+	ring->size = log_buf_len;
+	ring->generation = 0;
+	ring->node = node;
+	ring->first_seq = 0;
+	ring->first_idx = 0;
+	ring->next_seq = 0;
+	ring->next_idx = 0;
+	ring->last_seq = LOG_SEQ_NONE;
+	ring->repeat_seq = LOG_SEQ_NONE;
+	seqcount_init(&ring->pos_seq);
+	ring->mmap_pos = &log_mmap_header->rings[log_nr_rings];
 	return 0;
 }
 
-static int
-secure_log_release(struct inode *inode, struct file *file)
+static void
+destroy_log_cold(struct log_cold *cold)
 {
-	struct user_data *data = file->private_data;
+	struct log_cold_block *block, *next;
 
-	if (data == NULL)
-		return 0;
+	if (cold == NULL)
+		return;
+	list_for_each_entry_safe(block, next, &cold->blocks, list)
+		kfree(block);
+	vfree(cold->raw);
+	kfree(cold);
+}
 
-	mutex_destroy(&data->lock);
-	kfree(data);
+static int __init
+init_log_cold(struct log_ring *ring)
+{
+	struct log_cold *cold;
 
+	cold = kzalloc(sizeof(*cold), GFP_KERNEL);
+	if (cold == NULL)
+		return -ENOMEM;
+	INIT_LIST_HEAD(&cold->blocks);
+	cold->raw = vmalloc(LOG_COLD_BLOCK);
+	if (cold->raw == NULL) {
+		kfree(cold);
+		return -ENOMEM;
+	}
+	/* The copy starts with the first record */
+	cold->cursor.generation = ring->generation;
+	ring->cold = cold;
 	return 0;
 }
 
+static void
+destroy_log_rings(void)
+{
+	unsigned int i, cpu;
 
-static const struct file_operations secure_log_fops = {
-	.owner = THIS_MODULE,
-	.open = secure_log_open,
-	.read = secure_log_read,
-	.llseek = secure_log_llseek,
-	.poll = secure_log_poll,
-	.release = secure_log_release,
-};
+	for (i = 0; i < log_nr_rings; ++i) {
+		vfree(log_rings[i]->buf);
+		vfree(log_rings[i]->index);
+		destroy_log_cold(log_rings[i]->cold);
+	}
+	kfree(log_rings);
+	vfree(log_mmap_header);
+	vfree(log_cold_comp);
+	vfree(log_cold_wrkmem);
+	kfree(log_cold_record);
+	for_each_possible_cpu(cpu)
+		vfree(per_cpu_ptr(&log_cold_scratch, cpu)->raw);
+}
+
+static int __init
+init_log_rings(void)
+{
+	unsigned int cpu, nr_rings, nr_types, i;
+	struct log_ring *ring;
+	int err, node;
 
+	nr_types = per_type_buffers ? LOG_NR_TYPES : 1;
+	nr_rings = (per_cpu_buffers ? num_possible_cpus() : 1) * nr_types;
+
+	/* Mapped into userspace too, thus page aligned */
+	log_mmap_header_size = PAGE_ALIGN(sizeof(*log_mmap_header) +
+					  nr_rings * sizeof(log_mmap_header->rings[0]));
+	log_mmap_header = vzalloc(log_mmap_header_size);
+	if (log_mmap_header == NULL)
+		return -ENOMEM;
+	log_mmap_header->version = SECURE_LOG_MMAP_VERSION;
+	log_mmap_header->nr_rings = nr_rings;
+	log_mmap_header->data_offset = log_mmap_header_size;
+	log_mmap_header->record_align = LOG_ALIGN;
+	log_mmap_header->nr_types = nr_types;
+
+	log_rings = kcalloc(nr_rings, sizeof(*log_rings), GFP_KERNEL);
+	if (log_rings == NULL) {
+		vfree(log_mmap_header);
+		return -ENOMEM;
+	}
+
+	/* Grouped by type, see secure_log_uapi.h */
+	for (i = 0; i < nr_types; ++i) {
+		for_each_possible_cpu(cpu) {
+			if (per_cpu_buffers) {
+				ring = per_cpu_ptr(&log_cpu_ring[i], cpu);
+				node = cpu_to_node(cpu);
+			} else {
+				ring = &log_shared_ring[i];
+				node = NUMA_NO_NODE;
+			}
+			err = init_log_ring(ring, node);
+			if (err < 0) {
+				destroy_log_rings();
+				return err;
+			}
+			ring->cpu = per_cpu_buffers ? (int)cpu : -1;
+			log_rings[log_nr_rings++] = ring;
+			if (cold_size)
+				err = init_log_cold(ring);
+			if (err < 0) {
+				destroy_log_rings();
+				return err;
+			}
+			if (!per_cpu_buffers)
+				break;
+		}
+	}
+	log_mmap_layout();
+
+	if (cold_size == 0)
+		return 0;
+#ifdef LOG_COLD_LZ4
+	log_cold_comp = vmalloc(LOG_COLD_COMP_SIZE);
+	log_cold_wrkmem = vmalloc(LZ4_MEM_COMPRESS);
+	log_cold_record = kmalloc(RECORD_SNAPSHOT_SIZE, GFP_KERNEL);
+	if (log_cold_comp == NULL || log_cold_wrkmem == NULL ||
+	    log_cold_record == NULL) {
+		destroy_log_rings();
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu) {
+		per_cpu_ptr(&log_cold_scratch, cpu)->raw =
+			vmalloc_node(LOG_COLD_BLOCK, cpu_to_node(cpu));
+		if (per_cpu_ptr(&log_cold_scratch, cpu)->raw == NULL) {
+			destroy_log_rings();
+			return -ENOMEM;
+		}
+	}
+	return 0;
+#else /* !LOG_COLD_LZ4 */
+	pr_err("cold_size requires the kernel LZ4 library\n");
+	destroy_log_rings();
+	return -EINVAL;
+#endif /* ?LOG_COLD_LZ4 */
+}
+
+/* Minors: /dev/secure_log, then /dev/secure_log_<type> for each type of
+ * record if they have separate buffers */
+static unsigned int
+secure_log_nr_minors(void)
+{
+	return per_type_buffers ? 1 + LOG_NR_TYPES : 1;
+}
 
 static int __init
 init_secure_dev(void)
 {
+	struct device *type_dev;
+	unsigned int type, i;
 	int err;
 
+	for (i = 0; i < LOG_PATH_HASH_SIZE; ++i)
+		INIT_LIST_HEAD(&log_path_hash[i]);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+	timer_setup(&log_repeat_timer, log_repeat_timer_fn, 0);
+#else /* LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0) */
+	setup_timer(&log_repeat_timer, log_repeat_timer_fn, 0);
+#endif /* LINUX_VERSION_CODE ? KERNEL_VERSION(4, 15, 0) */
+
+	err = init_log_rings();
+	if (err < 0)
+		return err;
+
 	secure_class = class_create(THIS_MODULE, MODULE_NAME);
-	if (IS_ERR(secure_class))
-		return PTR_ERR(secure_class);
+	if (IS_ERR(secure_class)) {
+		err = PTR_ERR(secure_class);
+		goto clean_rings;
+	}
 
-	err =  alloc_chrdev_region(&secure_dev, 0, 1, MODULE_NAME);
+	err =  alloc_chrdev_region(&secure_dev, 0, secure_log_nr_minors(),
+				   MODULE_NAME);
 	if (err < 0)
 		goto clean_class;
 
 	cdev_init(&secure_c_dev, &secure_log_fops);
-	err = cdev_add(&secure_c_dev, secure_dev, 1);
+	err = cdev_add(&secure_c_dev, secure_dev, secure_log_nr_minors());
 	if (err < 0)
 		goto clean_chrdev_region;
 
@@ -691,15 +4444,42 @@ init_secure_dev(void)
 		goto clean_cdev;
 	}
 
+	for (type = 1; type < secure_log_nr_minors(); ++type) {
+		type_dev = device_create(secure_class, NULL,
+					 MKDEV(MAJOR(secure_dev),
+					       MINOR(secure_dev) + type),
+					 NULL, MODULE_NAME"_%s",
+					 get_module_name(type - 1));
+		if (IS_ERR(type_dev)) {
+			err = PTR_ERR(type_dev);
+			goto clean_devices;
+		}
+	}
+
+	if (cold_size)
+		schedule_delayed_work(&log_cold_dwork, LOG_COLD_INTERVAL);
+
+	/* Statistics are optional, ignore any error */
+	log_debugfs = debugfs_create_dir(MODULE_NAME, NULL);
+	if (!IS_ERR_OR_NULL(log_debugfs))
+		debugfs_create_file("stats", 0400, log_debugfs, NULL,
+				    &log_stats_fops);
+
 	dev_info(dev, "[+] Created /dev/"MODULE_NAME" for logs\n");
 	return 0;
 
+clean_devices:
+	while (type-- > 0)
+		device_destroy(secure_class, MKDEV(MAJOR(secure_dev),
+						   MINOR(secure_dev) + type));
 clean_cdev:
 	cdev_del(&secure_c_dev);
 clean_chrdev_region:
-	unregister_chrdev_region(secure_dev, 1);
+	unregister_chrdev_region(secure_dev, secure_log_nr_minors());
 clean_class:
 	class_destroy(secure_class);
+clean_rings:
+	destroy_log_rings();
 	return err;
 }
 
@@ -708,11 +4488,24 @@ module_init(init_secure_dev)
 static void __exit
 destroy_secure_dev(void)
 {
+	unsigned int minor;
+	u32 id;
+
 	dev_info(dev, "[+] Removing /dev/"MODULE_NAME"\n");
-	device_destroy(secure_class, secure_dev);
+	if (!IS_ERR_OR_NULL(log_debugfs))
+		debugfs_remove_recursive(log_debugfs);
+	if (cold_size)
+		cancel_delayed_work_sync(&log_cold_dwork);
+	for (minor = 0; minor < secure_log_nr_minors(); ++minor)
+		device_destroy(secure_class, MKDEV(MAJOR(secure_dev),
+						   MINOR(secure_dev) + minor));
 	cdev_del(&secure_c_dev);
-	unregister_chrdev_region(secure_dev, 1);
+	unregister_chrdev_region(secure_dev, secure_log_nr_minors());
 	class_destroy(secure_class);
+	del_timer_sync(&log_repeat_timer);
+	destroy_log_rings();
+	for (id = 1; id <= log_nr_paths; ++id)
+		kfree(log_paths[id]);
 	return;
 }
 
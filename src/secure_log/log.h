@@ -9,13 +9,22 @@
 enum secure_log_type {
 	LOG_NETWORK_INTERACTION  /** High level network interaction log */ = 0,
 	LOG_EXECUTION			/** Execve (file execution) with arguments log */,
+	LOG_PATH			/** Definition of an interned path, only generated when reading */ = 126,
+	LOG_GAP				/** Records lost by a reader, generated when reading, or stored when a resize dropped some */ = 127,
 };
 
+/* Number of types of records stored in the buffers */
+#define LOG_NR_TYPES (LOG_EXECUTION + 1)
 
-/* Size of the buffer containing the logs */
+
+/* Default size of the buffer containing the logs, see buffer_size */
 /* Make sure that '1' is big enough & unsigned */
 #define LOG_BUF_LEN (((unsigned int)1) << 20)
 
+/* Limits of the size of the buffer: indexes inside it are 32 bits */
+#define LOG_BUF_LEN_MIN LOG_BUF_LEN
+#define LOG_BUF_LEN_MAX (((unsigned int)1) << 31)
+
 /* Log facility and level for our devicde */
 #define LOG_FACILITY 0
 #define LOG_LEVEL    6
@@ -0,0 +1,234 @@
+#ifndef __SECURE_LOG_UAPI__
+#define __SECURE_LOG_UAPI__
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Interface of /dev/secure_log shared with userspace readers
+ */
+
+/*
+ * mmap() view of the buffers
+ *
+ * The device can be mapped read-only. The mapping starts with a header
+ * (struct secure_log_mmap_header, 'data_offset' bytes long), followed by
+ * 'nr_rings' buffers, in the same order as the 'rings' positions of the
+ * header. Each buffer is 'size' bytes long and starts 'offset' bytes
+ * into the mapping, both being multiples of the page size.
+ *
+ * Each buffer contains raw records (struct sec_log followed by the
+ * netlog_log or execlog_log payload), aligned on 'record_align' bytes.
+ * A record with a zero length indicates that the next record is at the
+ * start of the buffer. A record can only be used once its 'committed'
+ * field is set and must be copied before being parsed: it can be
+ * overwritten at any time, which is detected by re-reading 'first_seq'
+ * after the copy. With coalesce_ms set, the 'repeat' and 'repeat_nsec'
+ * fields of the last record of a buffer can still change after it was
+ * committed, for up to coalesce_ms.
+ *
+ * With intern_paths set, netlog records may only contain the id of the
+ * path of their executable ('path_id', their path is then empty), which
+ * SECURE_LOG_IOC_GET_PATH translates. Ids are never reused while the
+ * module is loaded.
+ *
+ * With per_type_buffers, each type of record has its own buffers: they are
+ * grouped by type, the buffers of type T being the (nr_rings / nr_types)
+ * ones starting at T * (nr_rings / nr_types). Otherwise nr_types is 1.
+ *
+ * The buffers can be resized at runtime (buffer_size parameter), which
+ * changes the 'generation' of every buffer: the device must then be
+ * mapped again, the old mapping keeps showing the old buffers. The
+ * 'offset' and 'size' of the buffers must be read again from the new
+ * mapping. The records
+ * dropped during a resize are reported by a LOG_GAP record (struct gap_log
+ * of log.c) stored in the new buffers.
+ */
+#define SECURE_LOG_MMAP_VERSION 4
+
+/* Positions inside one buffer */
+struct secure_log_mmap_ring {
+	__u32 lock      /** Odd while the positions are updated, changed by each update */;
+	__u32 first_idx /** Index of the oldest record */;
+	__u32 next_idx  /** Index of the next record to be written */;
+	__u32 generation /** Changed each time the buffer is resized */;
+	__u64 first_seq /** Sequence number of the oldest record */;
+	__u64 next_seq  /** Sequence number of the next record to be written */;
+	__u64 offset    /** Offset of the buffer in the mapping */;
+	__u32 size      /** Size of the buffer */;
+	__u32 reserved;
+};
+
+struct secure_log_mmap_header {
+	__u32 version      /** SECURE_LOG_MMAP_VERSION */;
+	__u32 nr_rings     /** Number of buffers */;
+	__u32 data_offset  /** Offset of the first buffer in the mapping */;
+	__u32 ring_size    /** Size of each buffer, 0 if they differ: see rings[].size */;
+	__u32 record_align /** Alignment of the records */;
+	__u32 nr_types     /** Number of groups of buffers, one per type of record or 1 */;
+	__u32 reserved[2];
+	struct secure_log_mmap_ring rings[];
+};
+
+/*
+ * Binary output format (binary_format parameter)
+ *
+ * Each record returned by read() is encoded as follows, where 'varint'
+ * is an unsigned LEB128 integer (7 bits per byte, lowest bits first, the
+ * highest bit is set on all bytes but the last one) and 'string' is a
+ * varint length followed by that many bytes, without any '\0':
+ *  - varint: length of the rest of the record
+ *  - u8:     SECURE_LOG_BINARY_VERSION
+ *  - u8:     type of the record (enum secure_log_type)
+ *  - varint: timestamp, in nanoseconds
+ *  - varint: sequence number
+ *  - varint: pid, sid, ppid, uid, gid, euid, egid
+ *  - string: tty
+ * Followed, for LOG_NETWORK_INTERACTION, by:
+ *  - u8:     protocol (enum netlog_protocol)
+ *  - u8:     action (enum netlog_action)
+ *  - u8:     family (AF_INET or AF_INET6)
+ *  - varint: source port, destination port
+ *  - bytes:  source and destination addresses, 4 bytes each for AF_INET,
+ *            16 for AF_INET6 and none for other families
+ *  - varint: id of the path of the executable (intern_paths parameter),
+ *            0 if it is not interned
+ *  - string: path of the executable, empty if it is interned
+ * and, for LOG_EXECUTION, by:
+ *  - string: path of the executable
+ *  - string: arguments, separated by spaces
+ * and, for LOG_GAP (127), reporting records lost by the reader, whose
+ * header is zeroed except for the timestamp (and the sequence number when
+ * stored by a resize):
+ *  - varint: number N of types of records
+ *  - N varints: number of lost records of each type (LOG_NETWORK_INTERACTION,
+ *            LOG_EXECUTION, ...)
+ *  - varint: timestamp of the last record read before them, 0 if unknown
+ *  - varint: timestamp of the last lost record
+ * and, for LOG_PATH (126), defining an interned path before the first
+ * record of the reader using it, whose header is zeroed except for the
+ * timestamp:
+ *  - varint: id of the path
+ *  - string: path
+ * and finally, for all types:
+ *  - varint: number N of identical records coalesced into this one
+ *            (coalesce_ms parameter), which then stands for N + 1 records
+ *  - varint: timestamp of the last of them, 0 if N is 0
+ * Readers must skip any data remaining after the fields they know about.
+ */
+#define SECURE_LOG_BINARY_VERSION 2
+
+/*
+ * Seeking
+ *
+ * lseek(fd, seq, SEEK_SET) moves the reader to the first record whose
+ * sequence number (as exported by the binary format) is at least 'seq'.
+ * SEEK_SET and SEEK_END with a zero offset move to the oldest record and
+ * to the end of the buffer.
+ */
+
+/* ioctl commands */
+#define SECURE_LOG_IOC_MAGIC 0xB5
+
+/* Move the reader to the first record timestamped at or after the given
+ * time, in nanoseconds (same clock as the records) */
+#define SECURE_LOG_IOC_SEEK_NSEC _IOW(SECURE_LOG_IOC_MAGIC, 1, __u64)
+
+/* Statistics of a reader */
+struct secure_log_stats {
+	__u64 overwritten /** Records overwritten in the buffers since the module was loaded */;
+	__u64 lost        /** Records lost by this reader */;
+	__u64 gaps        /** Gap records returned to this reader */;
+};
+
+#define SECURE_LOG_IOC_GET_STATS _IOR(SECURE_LOG_IOC_MAGIC, 2, struct secure_log_stats)
+
+/*
+ * Wake up policy of a reader: blocking reads and poll() only return once
+ * 'events' records or 'bytes' bytes of records are available, or
+ * 'timeout_ms' milliseconds after the first one became available,
+ * whichever comes first. A zero field disables its condition, at least
+ * one must be set. The default is to wake up on every record
+ * (events = 1). Non-blocking reads always return what is available.
+ */
+struct secure_log_wakeup {
+	__u32 events;
+	__u32 bytes;
+	__u32 timeout_ms;
+	__u32 reserved;
+};
+
+#define SECURE_LOG_IOC_SET_WAKEUP _IOW(SECURE_LOG_IOC_MAGIC, 3, struct secure_log_wakeup)
+
+/*
+ * Filter of a reader: records not matching all its conditions are skipped
+ * without being formatted, nor waking the reader up. Gap records are
+ * always returned. An all-zero filter returns everything (the default).
+ */
+#define SECURE_LOG_FILTER_PATH_MAX 256
+
+#define SECURE_LOG_FILTER_UID 0x1 /** Check uid_min and uid_max */
+#define SECURE_LOG_FILTER_GID 0x2 /** Check gid_min and gid_max */
+#define SECURE_LOG_FILTER_ALL (SECURE_LOG_FILTER_UID | SECURE_LOG_FILTER_GID)
+
+struct secure_log_filter {
+	__u32 types     /** Mask of the types of records to return (1 << enum secure_log_type), 0 for all */;
+	__u32 flags     /** SECURE_LOG_FILTER_* */;
+	__u32 uid_min   /** Inclusive range of the uid of the process */;
+	__u32 uid_max;
+	__u32 gid_min   /** Inclusive range of the gid of the process */;
+	__u32 gid_max;
+	__u32 protocols /** netlog records: mask of the protocols (1 << enum netlog_protocol), 0 for all */;
+	__u32 actions   /** netlog records: mask of the actions (1 << enum netlog_action), 0 for all */;
+	__u32 path_len  /** Length of 'path', 0 for any path */;
+	char  path[SECURE_LOG_FILTER_PATH_MAX] /** Prefix of the path of the executable, not '\0' terminated */;
+};
+
+#define SECURE_LOG_IOC_SET_FILTER _IOW(SECURE_LOG_IOC_MAGIC, 4, struct secure_log_filter)
+
+/*
+ * Consumer groups: the readers which joined the same group share one
+ * position, created at the position of the first one. Each record is
+ * returned to only one of them, and only one blocked reader is woken up
+ * per available record. The filter and the wake up policy stay per
+ * reader, but the records skipped by the filter of a member are consumed
+ * for the whole group. A reader can't leave its group, it must be closed.
+ */
+#define SECURE_LOG_GROUP_NAME_MAX 32
+
+struct secure_log_group {
+	char name[SECURE_LOG_GROUP_NAME_MAX] /** '\0' terminated, not empty */;
+};
+
+#define SECURE_LOG_IOC_JOIN_GROUP _IOW(SECURE_LOG_IOC_MAGIC, 5, struct secure_log_group)
+
+/*
+ * Interned paths: translate the 'path_id' of a raw netlog record (see the
+ * mmap() view) into its path. Fails with ENOENT on unknown ids.
+ */
+#define SECURE_LOG_PATH_MAX 1024
+
+struct secure_log_path {
+	__u32 id  /** Set by the caller */;
+	__u32 len /** Length of 'path', without the '\0' */;
+	char  path[SECURE_LOG_PATH_MAX] /** '\0' terminated */;
+};
+
+#define SECURE_LOG_IOC_GET_PATH _IOWR(SECURE_LOG_IOC_MAGIC, 6, struct secure_log_path)
+
+/*
+ * Latency of a reader: histogram of the time between the storage of the
+ * records and their copy to userspace by read(), since the device was
+ * opened. Bucket N counts the latencies of N significant bits, in
+ * nanoseconds: bucket 0 is for 0, bucket N for [2^(N-1), 2^N) and the
+ * last one for everything above.
+ */
+#define SECURE_LOG_LATENCY_BUCKETS 32
+
+struct secure_log_latency {
+	__u64 buckets[SECURE_LOG_LATENCY_BUCKETS];
+};
+
+#define SECURE_LOG_IOC_GET_LATENCY _IOR(SECURE_LOG_IOC_MAGIC, 7, struct secure_log_latency)
+
+#endif /* __SECURE_LOG_UAPI__ */